@@ -18,23 +18,45 @@
 
 YY_DECL;
 
-extern FILE* yyin;
+static inline
+int yylex(YYSTYPE *yylval, yyscan_t yyscanner, document_t *document)
+{
+	if (document->pipe)
+		return token_pipe_next(document, &yylval->token);
+
+	return yylex_scan(yylval, yyscanner, document);
+}
 
-static const char *const yytname[];
-const char * const *token_name = yytname;
+extern FILE* yyin;
 
 void yyerror(yyscan_t yyscanner, document_t *document, const char *msg)
 {
-	fprintf(stderr, "l%d: %s\n", yyget_lineno(yyscanner), msg);
+	token_t *token;
+	size_t offset = 0;
+
+	/* the lexer stops early then */
+	if (document_over_budget(document))
+		return;
+
+	/* the end of the last token lexed, pipelined the lexer is ahead */
+	if (!list_empty(&document->tokens)) {
+		token = list_last_entry(&document->tokens, token_t, list);
+		offset = token->offset + token->length;
+	}
+
+	fprintf(stderr, "l%d: %s\n", document_lineno(document, offset), msg);
 }
 
-#define STATEMENT_NEW(tkn)					\
+#define LOOKAHEAD()						\
+	(yychar != YYEMPTY && yychar != YYEOF ? yylval.token : NULL)
+
+#define STATEMENT_NEW()						\
 do {								\
-	yyval.statement = statement_new(document, tkn,		\
-					yychar != YYEMPTY ?	\
-					yylval.token : NULL);	\
+	yyval.statement = statement_new(document, LOOKAHEAD());	\
 } while (0)
 
+#define STATEMENT_SKIPPED()	document_skip_statement(document, LOOKAHEAD())
+
 #define SETSECTION(name)		document_set_section(document, (name))
 #define SETSECTIONWITHARGS(name, args)	document_set_section_with_args(document, (name), (args))
 #define PREVIOUSSECTION()		document_previous_section(document)
@@ -45,6 +67,7 @@ do {								\
 %}
 
 %define api.pure full
+%define parse.error custom
 
 %union {
 	token_t *token;
@@ -131,6 +154,10 @@ change_section_directive:
 			SETSECTIONWITHARGS($name->txt, $section_args);
 		}
 	|	DIRECTIVE_SUBSECTION TOKEN {
+			document_add_diagnostic(document,
+						$1->offset + ($1->txt - $1->buf),
+						$1->offset + $1->length,
+						"unsupported .subsection");
 			YYERROR;
 		}
 	|	DIRECTIVE_PREVIOUS { PREVIOUSSECTION(); }
@@ -141,10 +168,17 @@ file_part_directive:
 		DIRECTIVE_IDENT TOKEN
 	;
 
+/* FILL and MAX, either can be left out as in .p2align 4,,10 */
+align_args:
+		%empty
+	|	align_args COMMA
+	|	align_args TOKEN
+	;
+
 section_part_directive:
 		DIRECTIVE_FILE tokens_space
 	|	change_section_directive
-	|	DIRECTIVE_ALIGN TOKEN
+	|	DIRECTIVE_ALIGN TOKEN align_args
 	;
 
 symbol_part_directive:
@@ -156,43 +190,43 @@ symbol_part_directive:
 
 symbol_info_directive:
 		DIRECTIVE_WEAK	TOKEN[symbol] {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_weak(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_GLOBL TOKEN[symbol] {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_globl_or_local(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_LOCAL TOKEN[symbol] {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_globl_or_local(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_HIDDEN TOKEN[symbol] {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_hidden(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_PROTECTED TOKEN[symbol] {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_protected(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_INTERNAL TOKEN[symbol] {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_internal(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_TYPE[directive] TOKEN[symbol] COMMA TOKEN[type] {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_type(document, $symbol->txt, $$, $type);
 		}
 	|	DIRECTIVE_SIZE TOKEN[symbol] COMMA TOKEN {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_size(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_COMM TOKEN[symbol] COMMA tokens_comma {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_comm(document, $symbol->txt, $$);
 		}
 	|	DIRECTIVE_SET TOKEN[symbol] COMMA tokens {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_set(document, $symbol->txt, $$);
 		}
 	;
@@ -205,15 +239,15 @@ symbol_directive_or_tokens:
 
 statement_without_label:
 		symbol_directive_or_tokens {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			SYMBOL_ADD_STATEMENT($$);
 		}
 	|	section_part_directive {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			SECTION_ADD_STATEMENT($$);
 		}
 	|	file_part_directive {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 		}
 	|	symbol_info_directive
 	;
@@ -230,7 +264,7 @@ labels_tokens:
 
 labels:
 		labels_tokens {
-			STATEMENT_NEW($1);
+			STATEMENT_NEW();
 			symbol_set_label(document,
 				statement_last_token($$)->txt,
 				$$);
@@ -260,6 +294,12 @@ end_of_statement:
 statements:
 		statements[head] statement end_of_statement
 	|	statement end_of_statement
+	|	statements[head] error end_of_statement {
+			STATEMENT_SKIPPED();
+		}
+	|	error end_of_statement {
+			STATEMENT_SKIPPED();
+		}
 	;
 
 file:
@@ -269,3 +309,52 @@ file:
 	;
 
 %%
+
+const char *get_token_name(int token)
+{
+	return yysymbol_name(YYTRANSLATE(token));
+}
+
+#define YYEXPECTED_MAX	4
+
+/* Records the syntax error, the parser then skips to the end of statement */
+static int
+yyreport_syntax_error(const yypcontext_t *ctx, yyscan_t yyscanner,
+		      document_t *document)
+{
+	yysymbol_kind_t expected[YYNTOKENS];
+	yysymbol_kind_t unexpected = yypcontext_token(ctx);
+	char msg[512];
+	int i, n, len;
+	size_t offset, line_offset;
+	token_t *token;
+
+	/* the lexer stops early then */
+	if (document_over_budget(document))
+		return 0;
+
+	if (unexpected == YYSYMBOL_YYEOF || list_empty(&document->tokens)) {
+		offset = line_offset = document->offset;
+	} else {
+		/* the lookahead is the last token lexed */
+		token = list_last_entry(&document->tokens, token_t, list);
+		offset = token->offset + (token->txt - token->buf);
+		line_offset = token->offset + token->length;
+	}
+
+	len = snprintf(msg, sizeof(msg), "unexpected %s",
+		       yysymbol_name(unexpected));
+
+	/* anything would do at the start of a statement, not worth listing */
+	n = yypcontext_expected_tokens(ctx, expected, YYNTOKENS);
+	if (n > YYEXPECTED_MAX)
+		n = 0;
+	for (i = 0; i < n && len < (int)sizeof(msg); i++)
+		len += snprintf(msg + len, sizeof(msg) - len, "%s%s",
+				i ? " or " : ", expecting ",
+				yysymbol_name(expected[i]));
+
+	document_add_diagnostic(document, offset, line_offset, msg);
+
+	return 0;
+}
@@ -0,0 +1,539 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "document.h"
+
+/*
+ * Chunk-parallel parsing.
+ *
+ * The content is split at lines switching the section to an absolute one
+ * (.section, .text, .data and .bss) since these reset the current symbol and
+ * the only parser state that leaks into the chunk is the one consulted by
+ * .previous and .popsection.  Each chunk is parsed into its own document
+ * starting in a placeholder section, then chunk documents are merged into
+ * the first one in order.  Chunks that consulted the placeholder are thrown
+ * away and reparsed sequentially on top of the merged document.
+ */
+
+#define CHUNK_SIZE_MIN		(1 << 20)
+#define CHUNKS_PER_JOB		4
+
+struct chunk {
+	size_t offset, size;
+	document_t *document;
+	int rv;
+};
+
+struct chunk_pool {
+	struct chunk *chunks;
+	int nchunks;
+	int next;
+};
+
+/* Prescan */
+
+/* @end includes the newline if there is one */
+static
+int is_section_switch(const char *p, const char *end)
+{
+	static const char *const directives[] = {
+		".section", ".text", ".data", ".bss", NULL
+	};
+	const char *const *d;
+	size_t len;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+
+	for (d = directives; *d; d++) {
+		len = strlen(*d);
+		/* longer TOKEN or LABEL wins unless the directive is delimited */
+		if ((size_t)(end - p) > len && !memcmp(p, *d, len) &&
+		    memchr(" \t\n;,[]", p[len], 7))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Tracks whether the lexer might be inside a multiline string at the end of
+ * the line.  Errs on the side of being inside. */
+static
+int scan_line_quotes(const char *p, const char *eol, int in_string)
+{
+	const char *q = p;
+
+	if (!in_string) {
+		if (*p == '#')
+			return 0;
+		q = memchr(p, '"', eol - p);
+		if (q == NULL)
+			return 0;
+	}
+
+	for (; q < eol; q++) {
+		if (in_string) {
+			if (*q == '\\')
+				q++;
+			else if (*q == '"')
+				in_string = 0;
+		} else if (*q == '"' &&
+			   (q == p || memchr(" \t[];,:\"", q[-1], 8))) {
+			in_string = 1;
+		}
+	}
+
+	return in_string;
+}
+
+static
+int chunks_prescan(const char *content, size_t size, size_t chunk_size,
+		   struct chunk **pchunks)
+{
+	const char *p = content, *end = content + size, *eol;
+	struct chunk *chunks = NULL, *c;
+	int nchunks = 0, in_string = 0;
+	size_t last = 0;
+
+	while (p < end) {
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+
+		if ((nchunks == 0 ||
+		     (size_t)(p - content) >= last + chunk_size) &&
+		    !in_string &&
+		    (nchunks == 0 || is_section_switch(p, eol + (eol < end)))) {
+			if (!(nchunks & (nchunks - 1))) {
+				chunks = realloc(chunks,
+						 sizeof(*chunks) * (nchunks ? nchunks * 2 : 1));
+				if (chunks == NULL)
+					abort();
+			}
+
+			last = p - content;
+			c = &chunks[nchunks++];
+			memset(c, 0, sizeof(*c));
+			c->offset = last;
+		}
+
+		in_string = scan_line_quotes(p, eol, in_string);
+
+		p = eol + 1;
+	}
+
+	for (c = chunks; c < chunks + nchunks - 1; c++)
+		c->size = c[1].offset - c->offset;
+	if (nchunks)
+		c->size = size - c->offset;
+
+	*pchunks = chunks;
+	return nchunks;
+}
+
+/* Parsing */
+
+static
+document_t *chunk_document_new(document_t *main)
+{
+	document_t *document;
+
+	document = document_new_mem(main->mem);
+	document->content = main->content;
+	document->size = main->size;
+	document->lazy_symbols = main->lazy_symbols;
+
+	/* Replace the .text document_new() starts with */
+	section_free(document, document->sections);
+	document->chunk_entry = section_new(document, "<chunk entry>");
+	document->sections = document->section = document->chunk_entry;
+
+	return document;
+}
+
+static
+void *chunk_worker(void *arg)
+{
+	struct chunk_pool *pool = arg;
+	struct chunk *c;
+	int i;
+
+	while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) <
+	       pool->nchunks) {
+		c = &pool->chunks[i];
+		c->rv = document_parse_range(c->document, c->offset, c->size);
+	}
+
+	return NULL;
+}
+
+static
+void chunk_document_free(document_t *document)
+{
+	/* content is shared with the main document */
+	document->content = NULL;
+	document_free(document);
+}
+
+/* Merging */
+
+struct section_map {
+	section_t *from, *to;
+};
+
+static
+section_t *section_map_lookup(struct section_map *map, int n,
+			      section_t *from, section_t *entry)
+{
+	int i;
+
+	if (from == NULL)
+		return NULL;
+
+	for (i = 0; i < n; i++)
+		if (map[i].from == from)
+			return map[i].to;
+
+	return entry;
+}
+
+static
+void section_merge_ranges(document_t *document, section_t *m, section_t *s)
+{
+	struct stmt_range *last;
+	unsigned int i = 0;
+
+	if (s->nstatements == 0)
+		return;
+
+	/* the chunk picks up where the section left off in the previous
+	 * one, as a single range in the sequential parse */
+	last = m->nranges ? &m->ranges[m->nranges - 1] : NULL;
+	if (last && last->first->id + last->n == s->ranges[0].first->id) {
+		last->n += s->ranges[0].n;
+		i = 1;
+	}
+
+	for (; i < s->nranges; i++)
+		section_add_range(document, m, s->ranges[i].first,
+				  s->ranges[i].n);
+
+	if (m->nstatements == 0)
+		m->start = s->start;
+	m->end = s->end;
+	m->bytes += s->bytes;
+	m->nstatements += s->nstatements;
+}
+
+static
+struct section_map *merge_sections(document_t *document, document_t *chunk,
+				   int *pn)
+{
+	section_t *s, *ns, *m, *p, *head = NULL, **tail = &head;
+	struct section_map *map = NULL;
+	int n = 0;
+
+	for (s = chunk->sections; s; s = ns) {
+		ns = s->next;
+		if (s == chunk->chunk_entry)
+			continue;
+
+		for (p = NULL, m = document->sections; m; p = m, m = m->next)
+			if (!strcmp(m->name, s->name))
+				break;
+
+		if (m) {
+			if (p)
+				p->next = m->next;
+			else
+				document->sections = m->next;
+
+			m->type |= s->type;
+			section_merge_ranges(document, m, s);
+			stmt_vec_splice(document, &m->statements,
+					&s->statements);
+		} else {
+			m = s;
+		}
+
+		map = realloc(map, sizeof(*map) * (n + 1));
+		if (map == NULL)
+			abort();
+		map[n].from = s;
+		map[n].to = m;
+		n++;
+
+		*tail = m;
+		tail = &m->next;
+	}
+
+	/* sections used by the chunk are the most recently used ones */
+	*tail = document->sections;
+	document->sections = head;
+
+	*pn = n;
+	return map;
+}
+
+static
+void symbol_merge(document_t *document, struct symbol *m, struct symbol *s)
+{
+	int aux;
+
+	for (aux = 0; aux < SYMBOL_AUX_MAX; aux++)
+		if (s->aux_mask & (1u << aux))
+			symbol_set_aux(document, m, aux,
+				       symbol_get_aux(s, aux));
+
+	if (symbol_has(s, SYMBOL_HAS(type)))
+		m->type = s->type;
+
+	stmt_vec_splice(document, &m->statements, &s->statements);
+}
+
+static
+void merge_symbols(document_t *document, document_t *chunk,
+		   struct section_map *map, int nmap)
+{
+	struct symbol *s, *ns, *m, **order = NULL, *head = NULL, **tail = &head;
+	int i, n = 0, alloc = 0;
+
+	for (s = chunk->symbols_lru; s; s = ns) {
+		ns = s->next;
+
+		m = document_find_symbol(document, s->name);
+		if (m) {
+			symbol_merge(document, m, s);
+			symbol_free(chunk, s);
+		} else {
+			m = s;
+			m->section = section_map_lookup(map, nmap, m->section,
+							NULL);
+			document_insert_symbol(document, m);
+		}
+
+		if (n == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			order = realloc(order, sizeof(*order) * alloc);
+			if (order == NULL)
+				abort();
+		}
+		m->merged = 1;
+		order[n++] = m;
+	}
+	chunk->symbols_lru = NULL;
+
+	/* unlink the merged ones first, their ->next is about to change */
+	for (s = document->symbols_lru; s; s = ns) {
+		ns = s->next;
+		if (s->merged)
+			continue;
+		*tail = s;
+		tail = &s->next;
+	}
+	*tail = NULL;
+
+	/* symbols used by the chunk are the most recently used ones */
+	for (i = n - 1; i >= 0; i--) {
+		order[i]->next = head;
+		order[i]->merged = 0;
+		head = order[i];
+	}
+
+	document->symbols_lru = head;
+	symbols_lru_link(head);
+	free(order);
+}
+
+/* With lazy symbols the events of the chunk are recorded after the ones of
+ * the document, resolving these gives the same symbols as merging would */
+static
+void merge_symbol_events(document_t *document, document_t *chunk,
+			 struct section_map *map, int nmap)
+{
+	struct symbol_event *ev, *m;
+	size_t i;
+
+	for (i = 0; i < chunk->nsymbol_events; i++) {
+		ev = &chunk->symbol_events[i];
+		m = symbol_event_new(document);
+		*m = *ev;
+		m->section = section_map_lookup(map, nmap, ev->section, NULL);
+	}
+	chunk->nsymbol_events = 0;
+}
+
+static
+void chunk_merge(document_t *document, document_t *chunk)
+{
+	struct section_map *map;
+	struct diagnostic *diag;
+	statement_t *stmt;
+	section_t *section = document->section;
+	int i, nmap;
+
+	/* chunk statements are numbered from 0 */
+	document_for_each_statement(stmt, chunk)
+		stmt->id += document->nstatements;
+	document->nstatements += chunk->nstatements;
+
+	map = merge_sections(document, chunk, &nmap);
+
+	document->section = section_map_lookup(map, nmap, chunk->section,
+					       section);
+	document->prev_section = section_map_lookup(map, nmap,
+						    chunk->prev_section,
+						    section);
+
+	if (document->lazy_symbols)
+		merge_symbol_events(document, chunk, map, nmap);
+	else
+		merge_symbols(document, chunk, map, nmap);
+	document->current_symbol = NULL;
+	document->current_name = NULL;
+
+	for (i = 0; i < chunk->ndiags; i++) {
+		diag = &chunk->diags[i];
+		document_add_diagnostic(document, diag->offset,
+					diag->line_offset, diag->msg);
+		document->diags[document->ndiags - 1].stmt = diag->stmt;
+	}
+	document->diags_skipped = document->ndiags;
+
+	for (i = 0; i < nmap; i++)
+		if (map[i].from != map[i].to)
+			section_free(chunk, map[i].from);
+
+	list_append(&document->tokens, &chunk->tokens);
+	list_del(&chunk->tokens);
+	list_append(&document->statements, &chunk->statements);
+	list_del(&chunk->statements);
+
+	/* only the placeholder is left, the rest is merged or adopted */
+	chunk->sections = chunk->chunk_entry;
+	chunk->chunk_entry->next = NULL;
+	chunk_document_free(chunk);
+	free(map);
+}
+
+/* The chunk took the labels of a section that is executable once the
+ * earlier chunks are merged the other way the sequential parse would */
+static
+int chunk_merge_conflicts(document_t *document, document_t *chunk)
+{
+	section_t *s, *m;
+
+	for (s = chunk->sections; s; s = s->next) {
+		if (!s->chunk_labels_checked)
+			continue;
+		m = document_find_section(document, s->name);
+		if (m && (m->type & SECTION_EXECUTABLE))
+			return 1;
+	}
+
+	return 0;
+}
+
+document_t *document_parse_chunks(const char *content, size_t size,
+				  const struct parse_opts *opts)
+{
+	struct parse_opts sequential_opts;
+	struct chunk_pool pool;
+	struct chunk *chunks;
+	document_t *document;
+	pthread_t *threads;
+	size_t chunk_size;
+	int i, nchunks, nthreads, failed = 0;
+
+	chunk_size = opts->chunk_size;
+	if (chunk_size == 0) {
+		chunk_size = size / (opts->jobs * CHUNKS_PER_JOB);
+		if (chunk_size < CHUNK_SIZE_MIN)
+			chunk_size = CHUNK_SIZE_MIN;
+	}
+
+	sequential_opts = *opts;
+	sequential_opts.jobs = 0;
+	sequential_opts.drop = 0;
+
+	nchunks = chunks_prescan(content, size, chunk_size, &chunks);
+	if (nchunks <= 1) {
+		free(chunks);
+		return document_parse_content_opts(content, size,
+						   &sequential_opts);
+	}
+
+	document = document_new();
+	document->mem->budget = opts->mem_budget;
+	document->content = content;
+	document->size = size;
+	document_mem_alloced(document, size);
+	chunks[0].document = document;
+	for (i = 1; i < nchunks; i++)
+		chunks[i].document = chunk_document_new(document);
+
+	pool.chunks = chunks;
+	pool.nchunks = nchunks;
+	pool.next = 0;
+
+	nthreads = opts->jobs < nchunks ? opts->jobs : nchunks;
+	threads = malloc(sizeof(*threads) * nthreads);
+	if (threads == NULL)
+		abort();
+
+	/* the calling thread is a worker too */
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, chunk_worker, &pool))
+			break;
+	nthreads = i;
+	chunk_worker(&pool);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	for (i = 0; i < nchunks; i++)
+		failed |= chunks[i].rv;
+
+	if (failed && document_over_budget(document)) {
+		i = 0;
+		goto err;
+	}
+
+	if (failed) {
+		for (i = 1; i < nchunks; i++)
+			chunk_document_free(chunks[i].document);
+		chunk_document_free(document);
+		free(chunks);
+		return document_parse_content_opts(content, size,
+						   &sequential_opts);
+	}
+
+	document_update_structs(document);
+
+	for (i = 1; i < nchunks; i++) {
+		if (!chunks[i].document->chunk_tainted &&
+		    !chunk_merge_conflicts(document, chunks[i].document)) {
+			chunk_merge(document, chunks[i].document);
+			continue;
+		}
+
+		chunk_document_free(chunks[i].document);
+		if (document_parse_range(document, chunks[i].offset,
+					 chunks[i].size))
+			goto err;
+		document_update_structs(document);
+	}
+
+	free(chunks);
+	return document;
+
+err:
+	for (i++; i < nchunks; i++)
+		chunk_document_free(chunks[i].document);
+	free(chunks);
+	document_report_budget(document);
+	document_free(document);
+	return NULL;
+}
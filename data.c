@@ -0,0 +1,680 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "document.h"
+#include "y.tab.h"
+
+/*
+ * Data decoding.
+ *
+ * The data directives of a symbol (.byte, .quad, .zero, .uleb128, .string,
+ * ...) are turned into the bytes these assemble to, laid out one after
+ * another, so that data symbols are compared or hashed with a memcmp()
+ * rather than token by token.  Operands other than plain numbers, symbol
+ * references mostly, are left zero in the image and listed as relocations
+ * along with their text.  Values are stored little-endian, as on x86.
+ *
+ * Labels and the directives listed in data_sizeless add no bytes, in
+ * compiler output the alignment sits between the objects rather than
+ * within these.  Anything else, .octa, .fill, .incbin, an instruction,
+ * makes the symbol undecodable.
+ */
+
+enum {
+	DATA_INT,
+	DATA_FLOAT,
+	DATA_ZERO,
+	DATA_ULEB128,
+	DATA_SLEB128,
+	DATA_STRING,
+};
+
+static const struct {
+	const char *name;
+	int kind;
+	/* bytes of each operand, for strings whether these end with a NUL */
+	int size;
+} data_directives[] = {
+	{ "byte", DATA_INT, 1 },
+	{ "short", DATA_INT, 2 },
+	{ "word", DATA_INT, 2 },
+	{ "value", DATA_INT, 2 },
+	{ "hword", DATA_INT, 2 },
+	{ "2byte", DATA_INT, 2 },
+	{ "int", DATA_INT, 4 },
+	{ "long", DATA_INT, 4 },
+	{ "4byte", DATA_INT, 4 },
+	{ "quad", DATA_INT, 8 },
+	{ "8byte", DATA_INT, 8 },
+	{ "single", DATA_FLOAT, 4 },
+	{ "float", DATA_FLOAT, 4 },
+	{ "double", DATA_FLOAT, 8 },
+	{ "zero", DATA_ZERO, 0 },
+	{ "skip", DATA_ZERO, 0 },
+	{ "space", DATA_ZERO, 0 },
+	{ "uleb128", DATA_ULEB128, 0 },
+	{ "sleb128", DATA_SLEB128, 0 },
+	{ "ascii", DATA_STRING, 0 },
+	{ "asciz", DATA_STRING, 1 },
+	{ "string", DATA_STRING, 1 },
+};
+
+/* Directives assembling to no bytes in the current section, and .cfi_* */
+static const char * const data_sizeless[] = {
+	"type", "size", "globl", "global", "local", "weak", "weakref",
+	"hidden", "protected", "internal", "set", "equ", "equiv", "comm",
+	"lcomm", "file", "loc", "loc_mark_labels", "ident", "symver",
+	"addrsig", "addrsig_sym", "section", "pushsection", "popsection",
+	"previous", "subsection", "text", "data", "bss", "arch", "cpu",
+	"syntax", "intel_syntax", "att_syntax", "variant_pcs",
+};
+
+/* Longest operand parsed as a floating point number */
+#define DATA_FLOAT_MAX		64
+/* Largest .zero decoded */
+#define DATA_ZERO_MAX		(1ULL << 24)
+
+static inline
+int is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static
+unsigned char *data_reserve(struct data_image *image, size_t n)
+{
+	unsigned char *p;
+
+	if (image->size + n > image->alloc) {
+		image->alloc = image->alloc ? image->alloc * 2 : 64;
+		if (image->alloc < image->size + n)
+			image->alloc = image->size + n;
+		image->bytes = realloc(image->bytes, image->alloc);
+		if (image->bytes == NULL)
+			abort();
+	}
+
+	p = image->bytes + image->size;
+	image->size += n;
+	return p;
+}
+
+static inline
+void data_put(struct data_image *image, unsigned long long value, int size)
+{
+	unsigned char *p = data_reserve(image, size);
+	int i;
+
+	for (i = 0; i < size; i++, value >>= 8)
+		p[i] = value;
+}
+
+static
+void data_reloc(struct data_image *image, const char *expr,
+		unsigned int length, int size)
+{
+	struct data_reloc *reloc;
+
+	if (image->nrelocs == image->relocs_alloc) {
+		image->relocs_alloc = image->relocs_alloc ?
+				      image->relocs_alloc * 2 : 16;
+		image->relocs = realloc(image->relocs, sizeof(*reloc) *
+					image->relocs_alloc);
+		if (image->relocs == NULL)
+			abort();
+	}
+
+	reloc = &image->relocs[image->nrelocs++];
+	reloc->offset = image->size;
+	reloc->size = size;
+	reloc->length = length;
+	reloc->expr = expr;
+
+	/* a LEB128 takes no room until it is resolved */
+	if (size)
+		memset(data_reserve(image, size), 0, size);
+}
+
+/* Parses the whole of [@p, @end) as an integer literal, returns -1 if it
+ * is anything else */
+static
+int data_parse_int(const char *p, const char *end, unsigned long long *pvalue)
+{
+	unsigned long long value = 0;
+	int base = 10, digit, negative = 0;
+
+	if (p < end && *p == '-') {
+		negative = 1;
+		p++;
+	}
+	if (p == end)
+		return -1;
+
+	if (*p == '0' && end - p > 2 && (p[1] == 'x' || p[1] == 'X')) {
+		base = 16;
+		p += 2;
+	} else if (*p == '0' && end - p > 2 && (p[1] == 'b' || p[1] == 'B')) {
+		base = 2;
+		p += 2;
+	} else if (*p == '0') {
+		base = 8;
+	}
+
+	for (; p < end; p++) {
+		if (*p >= '0' && *p <= '9')
+			digit = *p - '0';
+		else if (*p >= 'a' && *p <= 'f')
+			digit = *p - 'a' + 10;
+		else if (*p >= 'A' && *p <= 'F')
+			digit = *p - 'A' + 10;
+		else
+			return -1;
+		if (digit >= base)
+			return -1;
+		value = value * base + digit;
+	}
+
+	*pvalue = negative ? -value : value;
+	return 0;
+}
+
+static
+int data_parse_float(const char *p, const char *end, double *pvalue)
+{
+	char buf[DATA_FLOAT_MAX + 1], *tail;
+
+	if (end - p > DATA_FLOAT_MAX || p == end)
+		return -1;
+	memcpy(buf, p, end - p);
+	buf[end - p] = '\0';
+
+	*pvalue = strtod(buf, &tail);
+	return *tail ? -1 : 0;
+}
+
+static
+void data_put_leb128(struct data_image *image, unsigned long long value,
+		     int is_signed)
+{
+	unsigned char byte;
+	int more;
+
+	do {
+		byte = value & 0x7f;
+		if (is_signed) {
+			value = (long long)value >> 7;
+			more = !((value == 0 && !(byte & 0x40)) ||
+				 (value == ~0ULL && (byte & 0x40)));
+		} else {
+			value >>= 7;
+			more = value != 0;
+		}
+		*data_reserve(image, 1) = byte | (more ? 0x80 : 0);
+	} while (more);
+}
+
+/* Next operand of a list, the comma is skipped but parentheses are kept
+ * together.  Leading and trailing blanks are not part of it */
+static
+const char *data_next_operand(const char *p, const char *end,
+			      const char **pstart, const char **pend)
+{
+	const char *q;
+	int depth = 0;
+
+	while (p < end && is_blank(*p))
+		p++;
+	*pstart = p;
+
+	for (; p < end; p++) {
+		if (*p == '(')
+			depth++;
+		else if (*p == ')')
+			depth--;
+		else if (*p == ',' && depth <= 0)
+			break;
+	}
+
+	for (q = p; q > *pstart && is_blank(q[-1]); q--)
+		;
+	*pend = q;
+
+	return p < end ? p + 1 : p;
+}
+
+/* The byte count of a .zero, -1 if it is no literal, negative or larger
+ * than DATA_ZERO_MAX */
+static
+int data_parse_count(const char *p, const char *end,
+		     unsigned long long *pcount)
+{
+	if (p < end && *p == '-')
+		return -1;
+	if (data_parse_int(p, end, pcount) || *pcount > DATA_ZERO_MAX)
+		return -1;
+	return 0;
+}
+
+static
+int data_decode_numbers(struct data_image *image, int kind, int size,
+			const char *p, const char *end)
+{
+	const char *start, *stop;
+	unsigned long long value, fill;
+	union {
+		float f;
+		double d;
+		unsigned int u32;
+		unsigned long long u64;
+	} fp;
+	double d;
+
+	while (p < end) {
+		p = data_next_operand(p, end, &start, &stop);
+		if (start == stop)
+			return -1;
+
+		switch (kind) {
+		case DATA_INT:
+			if (data_parse_int(start, stop, &value))
+				data_reloc(image, start, stop - start, size);
+			else
+				data_put(image, value, size);
+			break;
+		case DATA_FLOAT:
+			if (data_parse_float(start, stop, &d))
+				return -1;
+			if (size == 4) {
+				fp.f = d;
+				data_put(image, fp.u32, 4);
+			} else {
+				fp.d = d;
+				data_put(image, fp.u64, 8);
+			}
+			break;
+		case DATA_ZERO:
+			/* .zero SIZE[, FILL] */
+			if (data_parse_count(start, stop, &value))
+				return -1;
+			fill = 0;
+			if (p < end) {
+				p = data_next_operand(p, end, &start, &stop);
+				if (data_parse_int(start, stop, &fill) ||
+				    p < end)
+					return -1;
+			}
+			memset(data_reserve(image, value), fill, value);
+			break;
+		case DATA_ULEB128:
+		case DATA_SLEB128:
+			if (data_parse_int(start, stop, &value))
+				data_reloc(image, start, stop - start, 0);
+			else
+				data_put_leb128(image, value,
+						kind == DATA_SLEB128);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static
+const char *data_decode_escape(struct data_image *image, const char *p,
+			       const char *end)
+{
+	unsigned int value = 0;
+	int i;
+
+	if (p == end)
+		return NULL;
+
+	switch (*p) {
+	case 'b': value = '\b'; break;
+	case 'f': value = '\f'; break;
+	case 'n': value = '\n'; break;
+	case 'r': value = '\r'; break;
+	case 't': value = '\t'; break;
+	case 'x':
+	case 'X':
+		/* as many hex digits as there are, the low byte is kept */
+		for (p++; p < end; p++) {
+			if (*p >= '0' && *p <= '9')
+				value = value * 16 + *p - '0';
+			else if ((*p | 0x20) >= 'a' && (*p | 0x20) <= 'f')
+				value = value * 16 + (*p | 0x20) - 'a' + 10;
+			else
+				break;
+		}
+		*data_reserve(image, 1) = value;
+		return p;
+	default:
+		if (*p >= '0' && *p <= '7') {
+			for (i = 0; i < 3 && p < end && *p >= '0' && *p <= '7';
+			     i++, p++)
+				value = value * 8 + *p - '0';
+			*data_reserve(image, 1) = value;
+			return p;
+		}
+		/* \\, \" and the unknown ones stand for the character */
+		value = *p;
+		break;
+	}
+
+	*data_reserve(image, 1) = value;
+	return p + 1;
+}
+
+/* The runs between escapes are found with memchr(), which libc vectorizes,
+ * and copied at once */
+static
+int data_decode_strings(struct data_image *image, int nul, const char *p,
+			const char *end)
+{
+	const char *quote = NULL, *escape = NULL;
+	size_t n;
+
+	while (p < end) {
+		while (p < end && (is_blank(*p) || *p == ','))
+			p++;
+		if (p == end)
+			break;
+		if (*p++ != '"')
+			return -1;
+
+		for (;;) {
+			if (quote == NULL || quote < p)
+				quote = memchr(p, '"', end - p);
+			if (quote == NULL)
+				return -1;
+			if (escape == NULL || escape < p)
+				escape = memchr(p, '\\', end - p);
+
+			n = (escape && escape < quote ? escape : quote) - p;
+			memcpy(data_reserve(image, n), p, n);
+			p += n;
+			if (p == quote)
+				break;
+
+			p = data_decode_escape(image, p + 1, end);
+			if (p == NULL)
+				return -1;
+		}
+
+		p++;
+		if (nul)
+			*data_reserve(image, 1) = '\0';
+	}
+
+	return 0;
+}
+
+/* A label, the texts of these lack the ':' */
+static
+int data_is_label(statement_t *stmt)
+{
+	const char *p = stmt->text, *end = stmt->text + stmt->length;
+
+	if (stmt->tokens)
+		return stmt->tokens->type == LABEL ||
+		       stmt->tokens->type == LLABEL;
+
+	/* the tokens are dropped: a local or numeric one, no directive or
+	 * instruction looks like these */
+	if (memchr(p, ' ', end - p) || memchr(p, '\t', end - p))
+		return 0;
+	return (end - p > 2 && p[0] == '.' && p[1] == 'L') ||
+	       (p < end && *p >= '0' && *p <= '9');
+}
+
+/* Index in data_directives of the directive of @stmt, DATA_SIZELESS if it
+ * adds no bytes and DATA_UNKNOWN if that is not known.  @pp is set past
+ * the name */
+#define DATA_SIZELESS	-1
+#define DATA_UNKNOWN	-2
+static
+int data_directive(statement_t *stmt, const char **pp)
+{
+	const char *p = stmt->text, *end = stmt->text + stmt->length, *name;
+	size_t length, i;
+
+	if (data_is_label(stmt))
+		return DATA_SIZELESS;
+
+	while (p < end && is_blank(*p))
+		p++;
+	if (p == end || *p != '.')
+		return DATA_UNKNOWN;
+
+	name = ++p;
+	while (p < end && !is_blank(*p))
+		p++;
+	length = p - name;
+	*pp = p;
+
+	for (i = 0; i < sizeof(data_directives) / sizeof(*data_directives);
+	     i++)
+		if (strlen(data_directives[i].name) == length &&
+		    !memcmp(data_directives[i].name, name, length))
+			return i;
+
+	if (length > 4 && !memcmp(name, "cfi_", 4))
+		return DATA_SIZELESS;
+	for (i = 0; i < sizeof(data_sizeless) / sizeof(*data_sizeless); i++)
+		if (strlen(data_sizeless[i]) == length &&
+		    !memcmp(data_sizeless[i], name, length))
+			return DATA_SIZELESS;
+
+	return DATA_UNKNOWN;
+}
+
+/* @copy is @stmt with a text, rebuilt from the tokens into @scratch once
+ * the content is dropped.  Returns -1 if neither is left */
+static
+int data_statement_text(statement_t *stmt, statement_t *copy, char **scratch)
+{
+	token_t *token;
+	char *p;
+
+	*copy = *stmt;
+	if (stmt->text)
+		return 0;
+	if (stmt->ntokens == 0)
+		return -1;
+
+	/* the data directives taking the rest of the line */
+	if (stmt->ntokens == 1) {
+		copy->text = stmt->tokens->buf;
+		copy->length = stmt->tokens->length;
+		return 0;
+	}
+
+	p = *scratch = realloc(*scratch, stmt->length);
+	if (p == NULL)
+		abort();
+	statement_for_each_token(token, stmt) {
+		memcpy(p, token->buf, token->length);
+		p += token->length;
+	}
+	copy->text = *scratch;
+	copy->length = p - *scratch;
+	return 0;
+}
+
+/* Whether @stmt is a data directive, see data_directives */
+int statement_is_data(statement_t *stmt)
+{
+	statement_t copy;
+	char *scratch = NULL;
+	const char *p;
+	int rv;
+
+	rv = !data_statement_text(stmt, &copy, &scratch) &&
+	     data_directive(&copy, &p) >= 0;
+	free(scratch);
+	return rv;
+}
+
+static
+int data_decode_statement(struct data_image *image, statement_t *stmt)
+{
+	const char *p, *end = stmt->text + stmt->length;
+	int i;
+
+	i = data_directive(stmt, &p);
+	if (i == DATA_UNKNOWN)
+		return -1;
+	if (i < 0)
+		return 0;
+
+	if (data_directives[i].kind == DATA_STRING)
+		return data_decode_strings(image, data_directives[i].size,
+					   p, end);
+	return data_decode_numbers(image, data_directives[i].kind,
+				   data_directives[i].size, p, end);
+}
+
+/* Bytes @stmt assembles to into @psize, 0 for a label or a directive of
+ * data_sizeless.  @scratch holds the decoded operands, a .zero is only
+ * counted.  Returns -1 if the size is not known here, depends on a symbol
+ * or the text is gone */
+int statement_data_size(statement_t *stmt, struct data_image *scratch,
+			size_t *psize)
+{
+	const char *p, *end, *start, *stop;
+	unsigned long long count;
+	size_t k;
+	int i;
+
+	*psize = 0;
+	if (stmt->text == NULL)
+		return -1;
+
+	i = data_directive(stmt, &p);
+	if (i == DATA_UNKNOWN)
+		return -1;
+	if (i < 0)
+		return 0;
+
+	if (data_directives[i].kind == DATA_ZERO) {
+		end = stmt->text + stmt->length;
+		data_next_operand(p, end, &start, &stop);
+		if (data_parse_count(start, stop, &count))
+			return -1;
+		*psize = count;
+		return 0;
+	}
+
+	scratch->size = 0;
+	scratch->nrelocs = 0;
+	if (data_decode_statement(scratch, stmt))
+		return -1;
+	/* a symbolic LEB128 takes as many bytes as its value needs */
+	for (k = 0; k < scratch->nrelocs; k++)
+		if (scratch->relocs[k].size == 0)
+			return -1;
+	*psize = scratch->size;
+	return 0;
+}
+
+/* Decodes the data directives of @s into @image, which is reset first.
+ * The relocations point into the statement texts or tokens.  Returns -1
+ * if an operand can not be decoded or both of these are gone */
+int symbol_decode_data(struct symbol *s, struct data_image *image)
+{
+	statement_t *stmt, copy;
+	char *scratch = NULL;
+	unsigned int i;
+	size_t nrelocs;
+	int rv = 0;
+
+	image->size = 0;
+	image->nrelocs = 0;
+
+	symbol_for_each_statement(stmt, i, s) {
+		/* its own label, the other ones are told apart by their
+		 * text once the tokens are gone */
+		if (stmt == symbol_aux(s, label))
+			continue;
+		nrelocs = image->nrelocs;
+		if (data_statement_text(stmt, &copy, &scratch) ||
+		    data_decode_statement(image, &copy) ||
+		    /* these would point into the scratch */
+		    (copy.text == scratch && image->nrelocs != nrelocs)) {
+			rv = -1;
+			break;
+		}
+	}
+
+	free(scratch);
+	return rv;
+}
+
+void data_image_free(struct data_image *image)
+{
+	free(image->bytes);
+	free(image->relocs);
+	memset(image, 0, sizeof(*image));
+}
+
+int data_image_equal(const struct data_image *a, const struct data_image *b)
+{
+	const struct data_reloc *ra, *rb;
+	size_t i;
+
+	if (a->size != b->size || a->nrelocs != b->nrelocs ||
+	    (a->size && memcmp(a->bytes, b->bytes, a->size)))
+		return 0;
+
+	for (i = 0; i < a->nrelocs; i++) {
+		ra = &a->relocs[i];
+		rb = &b->relocs[i];
+		if (ra->offset != rb->offset || ra->size != rb->size ||
+		    ra->length != rb->length ||
+		    memcmp(ra->expr, rb->expr, ra->length))
+			return 0;
+	}
+
+	return 1;
+}
+
+/* FNV-1a over the bytes and the relocation texts */
+unsigned long long data_image_hash(const struct data_image *image)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	const struct data_reloc *reloc;
+	size_t i, k;
+
+	for (i = 0; i < image->size; i++) {
+		hash ^= image->bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	for (i = 0; i < image->nrelocs; i++) {
+		reloc = &image->relocs[i];
+		hash ^= reloc->offset;
+		hash *= 0x100000001b3ULL;
+		for (k = 0; k < reloc->length; k++) {
+			hash ^= (unsigned char)reloc->expr[k];
+			hash *= 0x100000001b3ULL;
+		}
+	}
+
+	return hash;
+}
+
+void data_image_print(struct symbol *s, const struct data_image *image)
+{
+	const struct data_reloc *reloc;
+	size_t i;
+
+	printf("data: name = %s, size = %zu, relocs = %zu, hash = %016llx\n",
+	       s->name, image->size, image->nrelocs, data_image_hash(image));
+	for (i = 0; i < image->nrelocs; i++) {
+		reloc = &image->relocs[i];
+		printf("data: reloc = %zu, size = %u, expr = %.*s\n",
+		       reloc->offset, reloc->size, reloc->length, reloc->expr);
+	}
+}
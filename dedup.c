@@ -0,0 +1,534 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "document.h"
+#include "y.tab.h"
+
+/*
+ * Symbol bodies shared across documents.
+ *
+ * The texts of the statements of a symbol are looked up by content in a
+ * store that any number of documents use, possibly from several threads.
+ * Bodies are kept once and refcounted, the statements of each document
+ * with the very same text point their text into the shared copy and their
+ * tokens are freed, these are compared by text from then on.  Symbols with
+ * the same body are then told apart from the changed ones with a pointer
+ * compare.
+ *
+ * Bodies are the same up to the blanks and the numbering of the local
+ * labels, as compilers renumber these for a change anywhere in the file:
+ * runs of blanks outside of strings count as one, none at the ends of a
+ * statement or after a comma, and .L labels ending in a number (.L5,
+ * .LFB1234, .LVL3) are numbered in the order these first appear in the
+ * body.  symbol_compare() tells bodies apart the same way without a store.
+ */
+
+#define BODY_STORE_BUCKETS_MIN	1024
+#define BODY_LABELS_MIN		64
+
+struct body_store {
+	pthread_mutex_t lock;
+	struct symbol_body **buckets;
+	size_t nbuckets;
+	size_t nbodies, nrefs, bytes;
+};
+
+struct symbol_body {
+	struct body_store *store;
+	struct symbol_body *next;
+
+	unsigned long long hash;
+	unsigned int refcount;
+
+	unsigned int nstatements;
+	size_t length;
+	/* nstatements lengths followed by the texts */
+	unsigned int lengths[];
+};
+
+static inline
+char *body_text(struct symbol_body *body)
+{
+	return (char *)(body->lengths + body->nstatements);
+}
+
+struct body_store *body_store_new(void)
+{
+	struct body_store *store;
+
+	store = calloc(1, sizeof(*store));
+	if (store == NULL)
+		abort();
+
+	store->nbuckets = BODY_STORE_BUCKETS_MIN;
+	store->buckets = calloc(store->nbuckets, sizeof(*store->buckets));
+	if (store->buckets == NULL)
+		abort();
+	pthread_mutex_init(&store->lock, NULL);
+
+	return store;
+}
+
+/* Documents using the store must be freed before */
+void body_store_free(struct body_store *store)
+{
+	pthread_mutex_destroy(&store->lock);
+	free(store->buckets);
+	free(store);
+}
+
+/* Normalized text of a body, one line for each statement */
+struct body_norm {
+	char *buf;
+	size_t length, alloc;
+
+	/* local label names seen, open addressing over their hashes.  The
+	 * names are copied to the pool */
+	struct body_label {
+		size_t offset;
+		unsigned int length, number;
+	} *labels;
+	unsigned int nlabels, labels_alloc;
+	char *pool;
+	size_t pool_length, pool_alloc;
+
+	/* a statement text rebuilt from its tokens */
+	char *scratch;
+	size_t scratch_alloc;
+};
+
+static inline
+int is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static inline
+int is_name_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '$';
+}
+
+/* FNV-1a */
+static
+unsigned long long fnv1a(const char *p, size_t length)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	const char *end = p + length;
+
+	for (; p < end; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static
+void *grow(void *p, size_t *palloc, size_t need, size_t size)
+{
+	if (need <= *palloc)
+		return p;
+
+	*palloc = *palloc ? *palloc * 2 : 64;
+	if (*palloc < need)
+		*palloc = need;
+	p = realloc(p, *palloc * size);
+	if (p == NULL)
+		abort();
+	return p;
+}
+
+static
+void norm_put(struct body_norm *norm, const char *p, size_t length)
+{
+	norm->buf = grow(norm->buf, &norm->alloc, norm->length + length, 1);
+	memcpy(norm->buf + norm->length, p, length);
+	norm->length += length;
+}
+
+static
+void norm_labels_grow(struct body_norm *norm)
+{
+	struct body_label *labels = norm->labels, *label;
+	unsigned int alloc = norm->labels_alloc, i, k;
+
+	norm->labels_alloc = alloc ? alloc * 2 : BODY_LABELS_MIN;
+	norm->labels = calloc(norm->labels_alloc, sizeof(*norm->labels));
+	if (norm->labels == NULL)
+		abort();
+
+	for (i = 0; i < alloc; i++) {
+		if (labels[i].length == 0)
+			continue;
+		k = fnv1a(norm->pool + labels[i].offset, labels[i].length);
+		for (;; k++) {
+			label = &norm->labels[k & (norm->labels_alloc - 1)];
+			if (label->length == 0)
+				break;
+		}
+		*label = labels[i];
+	}
+	free(labels);
+}
+
+/* Number of the local label [@p, @p + @length) in the order of the first
+ * ones seen */
+static
+unsigned int norm_label(struct body_norm *norm, const char *p,
+			unsigned int length)
+{
+	struct body_label *label;
+	unsigned int k;
+
+	if (2 * (norm->nlabels + 1) > norm->labels_alloc)
+		norm_labels_grow(norm);
+
+	for (k = fnv1a(p, length);; k++) {
+		label = &norm->labels[k & (norm->labels_alloc - 1)];
+		if (label->length == 0)
+			break;
+		if (label->length == length &&
+		    !memcmp(norm->pool + label->offset, p, length))
+			return label->number;
+	}
+
+	norm->pool = grow(norm->pool, &norm->pool_alloc,
+			  norm->pool_length + length, 1);
+	memcpy(norm->pool + norm->pool_length, p, length);
+	label->offset = norm->pool_length;
+	label->length = length;
+	label->number = norm->nlabels++;
+	norm->pool_length += length;
+
+	return label->number;
+}
+
+/* Appends the text [@p, @end) of a statement, see the top */
+static
+void norm_text(struct body_norm *norm, const char *p, const char *end)
+{
+	const char *q, *digits;
+	int blank = 0, comma = 0, quoted = 0;
+	char number[16];
+	char prev = '\0';
+
+	while (p < end && is_blank(*p))
+		p++;
+
+	for (; p < end; prev = *p++) {
+		if (quoted) {
+			norm_put(norm, p, 1);
+			if (*p == '\\' && p + 1 < end)
+				norm_put(norm, ++p, 1);
+			else if (*p == '"')
+				quoted = 0;
+			continue;
+		}
+		if (is_blank(*p)) {
+			blank = !comma;
+			continue;
+		}
+		if (blank && *p != ',')
+			norm_put(norm, " ", 1);
+		blank = 0;
+		comma = *p == ',';
+
+		if (*p == '.' && p + 2 < end && p[1] == 'L' &&
+		    !is_name_char(prev)) {
+			for (q = p + 2; q < end && is_name_char(*q); q++)
+				;
+			for (digits = q; digits[-1] >= '0' &&
+			     digits[-1] <= '9'; digits--)
+				;
+			if (digits < q) {
+				norm_put(norm, p, digits - p);
+				norm_put(norm, number,
+					 snprintf(number, sizeof(number),
+						  "#%u", norm_label(norm, p,
+								    q - p)));
+				p = q - 1;
+				continue;
+			}
+		}
+
+		if (*p == '"')
+			quoted = 1;
+		norm_put(norm, p, 1);
+	}
+
+	norm_put(norm, "\n", 1);
+}
+
+static
+void norm_statement(struct body_norm *norm, statement_t *stmt)
+{
+	token_t *token, *last;
+	char *q;
+
+	if (stmt->text) {
+		norm_text(norm, stmt->text, stmt->text + stmt->length);
+		return;
+	}
+
+	/* as document_pin_text() would */
+	norm->scratch = grow(norm->scratch, &norm->scratch_alloc,
+			     stmt->length + stmt->ntokens, 1);
+	q = norm->scratch;
+	last = statement_last_token(stmt);
+	statement_for_each_token(token, stmt) {
+		memcpy(q, token->buf, token->length);
+		q += token->length;
+		if ((token->type == LABEL || token->type == LLABEL) &&
+		    token != last)
+			*q++ = ':';
+	}
+	norm_text(norm, norm->scratch, q);
+}
+
+static
+void norm_free(struct body_norm *norm)
+{
+	free(norm->buf);
+	free(norm->labels);
+	free(norm->pool);
+	free(norm->scratch);
+}
+
+/* The normalized text of the stored @body into @norm */
+static
+void norm_body(struct body_norm *norm, struct symbol_body *body)
+{
+	const char *text = body_text(body);
+	unsigned int i;
+
+	for (i = 0; i < body->nstatements; i++) {
+		norm_text(norm, text, text + body->lengths[i]);
+		text += body->lengths[i];
+	}
+}
+
+static
+int body_norm_equal(struct symbol_body *body, const struct body_norm *norm)
+{
+	struct body_norm stored = { 0 };
+	int rv;
+
+	norm_body(&stored, body);
+	rv = stored.length == norm->length &&
+	     !memcmp(stored.buf, norm->buf, norm->length);
+	norm_free(&stored);
+
+	return rv;
+}
+
+/* Returns 0 if the statements of the symbols are the same up to the blanks
+ * and the local label numbers */
+int symbol_body_compare(struct symbol *a, struct symbol *b)
+{
+	struct body_norm na = { 0 }, nb = { 0 };
+	unsigned int i;
+	int rv;
+
+	for (i = 0; i < a->statements.n; i++)
+		norm_statement(&na, stmt_vec_items(&a->statements)[i]);
+	for (i = 0; i < b->statements.n; i++)
+		norm_statement(&nb, stmt_vec_items(&b->statements)[i]);
+
+	rv = na.length != nb.length ||
+	     (na.length && memcmp(na.buf, nb.buf, na.length));
+	norm_free(&na);
+	norm_free(&nb);
+
+	return rv;
+}
+
+/* Whether @body has the very texts of @stmts */
+static
+int body_same_text(struct symbol_body *body, statement_t **stmts,
+		   unsigned int n)
+{
+	const char *text = body_text(body);
+	unsigned int i;
+
+	if (body->nstatements != n)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		if (body->lengths[i] != stmts[i]->length ||
+		    memcmp(text, stmts[i]->text, stmts[i]->length))
+			return 0;
+		text += stmts[i]->length;
+	}
+
+	return 1;
+}
+
+static
+void body_store_grow(struct body_store *store)
+{
+	struct symbol_body **buckets, *body, *next;
+	size_t i, nbuckets = store->nbuckets * 2;
+
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (buckets == NULL)
+		abort();
+
+	for (i = 0; i < store->nbuckets; i++) {
+		for (body = store->buckets[i]; body; body = next) {
+			next = body->next;
+			body->next = buckets[body->hash & (nbuckets - 1)];
+			buckets[body->hash & (nbuckets - 1)] = body;
+		}
+	}
+
+	free(store->buckets);
+	store->buckets = buckets;
+	store->nbuckets = nbuckets;
+}
+
+/* Returns a reference to the body of @stmts, the first one stored keeps
+ * its texts */
+static
+struct symbol_body *body_store_get(struct body_store *store,
+				   statement_t **stmts, unsigned int n)
+{
+	struct symbol_body *body, **bucket;
+	struct body_norm norm = { 0 };
+	unsigned long long hash;
+	size_t length = 0;
+	unsigned int i;
+	char *text;
+
+	for (i = 0; i < n; i++)
+		norm_statement(&norm, stmts[i]);
+	hash = fnv1a(norm.buf, norm.length);
+
+	pthread_mutex_lock(&store->lock);
+
+	bucket = &store->buckets[hash & (store->nbuckets - 1)];
+	for (body = *bucket; body; body = body->next)
+		if (body->hash == hash && body->nstatements == n &&
+		    body_norm_equal(body, &norm))
+			goto found;
+
+	for (i = 0; i < n; i++)
+		length += stmts[i]->length;
+
+	body = malloc(sizeof(*body) + sizeof(body->lengths[0]) * n + length);
+	if (body == NULL)
+		abort();
+
+	body->store = store;
+	body->hash = hash;
+	body->refcount = 0;
+	body->nstatements = n;
+	body->length = length;
+
+	text = body_text(body);
+	for (i = 0; i < n; i++) {
+		body->lengths[i] = stmts[i]->length;
+		memcpy(text, stmts[i]->text, stmts[i]->length);
+		text += stmts[i]->length;
+	}
+
+	body->next = *bucket;
+	*bucket = body;
+	store->nbodies++;
+	store->bytes += length;
+
+	if (store->nbodies > store->nbuckets)
+		body_store_grow(store);
+
+found:
+	body->refcount++;
+	store->nrefs++;
+	pthread_mutex_unlock(&store->lock);
+
+	norm_free(&norm);
+	return body;
+}
+
+void symbol_body_put(struct symbol_body *body)
+{
+	struct body_store *store = body->store;
+	struct symbol_body **p;
+
+	pthread_mutex_lock(&store->lock);
+
+	store->nrefs--;
+	if (--body->refcount == 0) {
+		p = &store->buckets[body->hash & (store->nbuckets - 1)];
+		while (*p != body)
+			p = &(*p)->next;
+		*p = body->next;
+
+		store->nbodies--;
+		store->bytes -= body->length;
+		free(body);
+	}
+
+	pthread_mutex_unlock(&store->lock);
+}
+
+/* The text of @stmt is in the store, its tokens are not needed */
+static
+void statement_free_tokens(document_t *document, statement_t *stmt)
+{
+	token_t *token = stmt->tokens, *next;
+	unsigned int i;
+
+	for (i = 0; i < stmt->ntokens; i++, token = next) {
+		next = token_next(token);
+		list_del(&token->list);
+		token_free(document, token);
+	}
+
+	stmt->tokens = NULL;
+	stmt->ntokens = 0;
+}
+
+/* Shares the bodies of all the symbols of the document through @store, the
+ * statement texts are pointed at the shared copies and the tokens of these
+ * statements freed */
+void document_share_bodies(document_t *document, struct body_store *store)
+{
+	struct symbol_body *body;
+	struct symbol *s;
+	statement_t **stmts;
+	const char *text;
+	unsigned int i;
+
+	document_for_each_symbol(s, document) {
+		if (s->body || s->statements.n == 0)
+			continue;
+
+		stmts = stmt_vec_items(&s->statements);
+		body = body_store_get(store, stmts, s->statements.n);
+		s->body = body;
+		/* renumbered, the statements keep their own texts */
+		if (!body_same_text(body, stmts, s->statements.n))
+			continue;
+
+		text = body_text(body);
+		for (i = 0; i < s->statements.n; i++) {
+			stmts[i]->text = text;
+			text += stmts[i]->length;
+			statement_free_tokens(document, stmts[i]);
+		}
+	}
+}
+
+void body_store_stats(struct body_store *store, size_t *nbodies,
+		      size_t *nrefs, size_t *bytes)
+{
+	pthread_mutex_lock(&store->lock);
+	*nbodies = store->nbodies;
+	*nrefs = store->nrefs;
+	*bytes = store->bytes;
+	pthread_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,199 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+
+#include "diff.h"
+
+static
+int text_compare(statement_t *stmt_a, statement_t *stmt_b)
+{
+	unsigned int length;
+	int rv;
+
+	length = stmt_a->length < stmt_b->length ? stmt_a->length :
+						   stmt_b->length;
+	rv = memcmp(stmt_a->text, stmt_b->text, length);
+	if (rv)
+		return rv;
+
+	return (stmt_a->length > stmt_b->length) -
+	       (stmt_a->length < stmt_b->length);
+}
+
+int statement_compare(statement_t *stmt_a, statement_t *stmt_b)
+{
+	token_t *a, *b;
+	unsigned int n;
+	int rv;
+
+	a = statement_first_token(stmt_a);
+	b = statement_first_token(stmt_b);
+
+	/* tokens were dropped */
+	if (a == NULL || b == NULL)
+		return text_compare(stmt_a, stmt_b);
+
+	n = stmt_a->ntokens < stmt_b->ntokens ? stmt_a->ntokens :
+						stmt_b->ntokens;
+	for (; n; n--, a = token_next(a), b = token_next(b)) {
+		rv = strcmp(a->txt, b->txt);
+		if (rv)
+			return rv;
+	}
+
+	return (stmt_b->ntokens > stmt_a->ntokens) -
+	       (stmt_a->ntokens > stmt_b->ntokens);
+}
+
+/* Compares the statements of the objects besides the data directives,
+ * these by the bytes they assemble to: .long 1 and .byte 1,0,0,0 are the
+ * same.  Returns -1 if either can not be decoded */
+static
+int object_compare(struct symbol *a, struct symbol *b)
+{
+	struct data_image ia = { 0 }, ib = { 0 };
+	statement_t *sa = NULL, *sb = NULL;
+	unsigned int i = 0, j = 0;
+	int rv = -1;
+
+	if (symbol_decode_data(a, &ia) || symbol_decode_data(b, &ib))
+		goto out;
+
+	rv = !data_image_equal(&ia, &ib);
+	while (!rv) {
+		for (; i < a->statements.n; i++)
+			if (!statement_is_data(sa = stmt_vec_items(
+						&a->statements)[i]))
+				break;
+		for (; j < b->statements.n; j++)
+			if (!statement_is_data(sb = stmt_vec_items(
+						&b->statements)[j]))
+				break;
+		if (i == a->statements.n || j == b->statements.n) {
+			rv = i != a->statements.n || j != b->statements.n;
+			break;
+		}
+		rv = !!statement_compare(sa, sb);
+		i++;
+		j++;
+	}
+
+out:
+	data_image_free(&ia);
+	data_image_free(&ib);
+	return rv;
+}
+
+/* Returns non-zero if the statements of the symbols differ */
+int symbol_compare(struct symbol *a, struct symbol *b)
+{
+	int rv;
+
+	/* same body, see dedup.c */
+	if (a->body && a->body == b->body)
+		return 0;
+
+	/* what dedup.c takes for the same body, then the same data */
+	if (a->statements.n == b->statements.n && !symbol_body_compare(a, b))
+		return 0;
+
+	if (a->type == STT_OBJECT && b->type == STT_OBJECT) {
+		rv = object_compare(a, b);
+		if (rv >= 0)
+			return rv;
+	}
+
+	return 1;
+}
+
+/* Returns non-zero if the statements in the sections differ */
+int section_compare(section_t *a, section_t *b)
+{
+	struct stmt_range *ra = a->ranges, *rb = b->ranges;
+	statement_t *sa, *sb;
+	unsigned int ia = 0, ib = 0;
+
+	if (a->nstatements != b->nstatements || a->bytes != b->bytes)
+		return 1;
+
+	/* ranges of the same statements may be split differently */
+	while (ra < a->ranges + a->nranges) {
+		if (ia == 0)
+			sa = ra->first;
+		if (ib == 0)
+			sb = rb->first;
+
+		if (statement_compare(sa, sb))
+			return 1;
+
+		if (++ia == ra->n) {
+			ra++;
+			ia = 0;
+		} else {
+			sa = document_statement_next(sa);
+		}
+		if (++ib == rb->n) {
+			rb++;
+			ib = 0;
+		} else {
+			sb = document_statement_next(sb);
+		}
+	}
+
+	return 0;
+}
+
+/* Calls @cb for each symbol that is changed, new in @right or removed from
+ * @left in the order of symbol names.  Returns the number of these. */
+int document_diff_symbols(document_t *left, document_t *right,
+			  symbol_diff_cb_t cb, void *arg)
+{
+	struct symbol *l, *r;
+	int rv, changes = 0;
+
+	l = document_first_symbol(left);
+	r = document_first_symbol(right);
+
+	while (l || r) {
+		if (l == NULL)
+			rv = 1;
+		else if (r == NULL)
+			rv = -1;
+		else
+			rv = strcmp(l->name, r->name);
+
+		if (rv < 0) {
+			cb(arg, l->name, SYMBOL_REMOVED);
+			changes++;
+			l = symbol_next(l);
+		} else if (rv > 0) {
+			cb(arg, r->name, SYMBOL_NEW);
+			changes++;
+			r = symbol_next(r);
+		} else {
+			if (symbol_compare(l, r)) {
+				cb(arg, r->name, SYMBOL_CHANGED);
+				changes++;
+			}
+			l = symbol_next(l);
+			r = symbol_next(r);
+		}
+	}
+
+	return changes;
+}
+
+const char *symbol_status2str(int status)
+{
+	switch (status) {
+	case SYMBOL_CHANGED:
+		return "changed";
+	case SYMBOL_NEW:
+		return "new";
+	case SYMBOL_REMOVED:
+		return "removed";
+	default:
+		return "unknown";
+	}
+}
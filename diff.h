@@ -0,0 +1,21 @@
+#ifndef DIFF_H_INCLUDED
+#define DIFF_H_INCLUDED
+
+#include "document.h"
+
+#define SYMBOL_CHANGED	1
+#define SYMBOL_NEW	2
+#define SYMBOL_REMOVED	3
+
+typedef void (*symbol_diff_cb_t)(void *arg, const char *name, int status);
+
+int statement_compare(statement_t *stmt_a, statement_t *stmt_b);
+int symbol_compare(struct symbol *a, struct symbol *b);
+int section_compare(section_t *a, section_t *b);
+
+int document_diff_symbols(document_t *left, document_t *right,
+			  symbol_diff_cb_t cb, void *arg);
+
+const char *symbol_status2str(int status);
+
+#endif /* DIFF_H_INCLUDED */
@@ -2,8 +2,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <memory.h>
+#include <limits.h>
 
 #include <elf.h>
+#include <sys/resource.h>
 
 
 #include "parse.h"
@@ -26,104 +28,420 @@ int STRNEQ(const char *a, const char *b)
 	return !STREQ(a, b);
 }
 
+/* Memory accounting */
+
+void document_mem_alloced(document_t *document, size_t size)
+{
+	struct mem_stats *mem;
+	size_t used, peak;
+
+	if (document == NULL)
+		return;
+
+	/* chunk documents share the stats of the main one */
+	mem = document->mem;
+	used = __atomic_add_fetch(&mem->used, size, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&mem->peak, __ATOMIC_RELAXED);
+	while (used > peak &&
+	       !__atomic_compare_exchange_n(&mem->peak, &peak, used, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void document_mem_freed(document_t *document, size_t size)
+{
+	if (document == NULL)
+		return;
+
+	__atomic_sub_fetch(&document->mem->used, size, __ATOMIC_RELAXED);
+}
+
+void *document_alloc(document_t *document, size_t size)
+{
+	void *p;
+
+	p = malloc(size);
+	if (p == NULL)
+		abort();
+
+	document_mem_alloced(document, size);
+
+	return p;
+}
+
+char *document_strndup(document_t *document, const char *str, size_t length)
+{
+	char *p;
+
+	p = strndup(str, length);
+	if (p == NULL)
+		abort();
+
+	document_mem_alloced(document, strlen(p) + 1);
+
+	return p;
+}
+
+/* Peak resident set size of the process in KiB */
+long mem_peak_rss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return -1;
+
+	return ru.ru_maxrss;
+}
+
+static inline
+void document_free_str(document_t *document, const char *str)
+{
+	document_mem_freed(document, strlen(str) + 1);
+	free((void *)str);
+}
+
+/* Line code */
+
+#define LINE_BLOCK_SHIFT	32
+
+static inline
+size_t line_block(size_t offset)
+{
+	return (unsigned long long)offset >> LINE_BLOCK_SHIFT;
+}
+
+/* Offsets of the newlines of the content.  These are counted first and
+ * filled in then, both with memchr() which libc vectorizes.  The offsets
+ * are kept in 32 bits, relative to the LINE_BLOCK_SHIFT sized block of the
+ * content they are in */
+static
+void document_index_lines(document_t *document)
+{
+	const char *p, *end = document->content + document->size;
+	size_t n = 0, nblocks, b = 0, off;
+
+	if (document->lines)
+		return;
+
+	for (p = document->content; (p = memchr(p, '\n', end - p)); p++)
+		n++;
+
+	nblocks = line_block(document->size) + 1;
+	document->lines = malloc(sizeof(*document->lines) * (n ? n : 1));
+	document->line_blocks = malloc(sizeof(*document->line_blocks) *
+				       (nblocks + 1));
+	if (document->lines == NULL || document->line_blocks == NULL)
+		abort();
+	document_mem_alloced(document, sizeof(*document->lines) * n +
+			     sizeof(*document->line_blocks) * (nblocks + 1));
+
+	for (p = document->content, n = 0;
+	     (p = memchr(p, '\n', end - p)); p++) {
+		off = p - document->content;
+		while (b <= line_block(off))
+			document->line_blocks[b++] = n;
+		document->lines[n++] = (unsigned int)off;
+	}
+	while (b <= nblocks)
+		document->line_blocks[b++] = n;
+	document->nlines = n;
+	document->nline_blocks = nblocks;
+}
+
+/* Line at @offset, that is 1 + the newlines before it */
+int document_lineno(document_t *document, size_t offset)
+{
+	const char *p, *end;
+	size_t lo, hi, mid, b;
+	int lineno = 1;
+
+	if (document->lines == NULL && document->content && document->size)
+		document_index_lines(document);
+
+	if (document->lines == NULL) {
+		/* the size is only known at the end of compressed input */
+		if (document->content == NULL)
+			return lineno;
+		end = document->content + offset;
+		for (p = document->content; (p = memchr(p, '\n', end - p));
+		     p++)
+			lineno++;
+		return lineno;
+	}
+
+	b = line_block(offset);
+	if (b >= document->nline_blocks)
+		return document->nlines + 1;
+
+	lo = document->line_blocks[b];
+	hi = document->line_blocks[b + 1];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (document->lines[mid] < (unsigned int)offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo + 1;
+}
+
+/* Offset where the line @lineno starts, -1 if there is no such line */
+long document_line_offset(document_t *document, int lineno)
+{
+	size_t i = lineno - 2, b = 0;
+
+	if (document->lines == NULL && document->content && document->size)
+		document_index_lines(document);
+
+	if (lineno == 1)
+		return 0;
+	if (document->lines == NULL || lineno < 1 || i >= document->nlines)
+		return -1;
+
+	while (document->line_blocks[b + 1] <= i)
+		b++;
+
+	return ((long)b << LINE_BLOCK_SHIFT | document->lines[i]) + 1;
+}
+
 /* Token code */
 
-void print_tokens(token_t *t, const char *prefix)
+void print_tokens(document_t *document, FILE *fh, token_t *t, unsigned int n,
+		  const char *prefix)
 {
-	token_t *nsbl = t, *ntkn = t;
 	if (t == NULL)
 		return;
 
+	/* the line the token ends on, a NEWLINE is on the next one */
 	if (prefix != NULL)
-		printf("%s(l%d)", prefix, t->lineno);
+		fprintf(fh, "%s(l%d)", prefix,
+			document_lineno(document, t->offset + t->length));
 
-	do {
-		printf("(%s)%s", get_token_name(ntkn->type), ntkn->buf);
+	for (; n; n--, t = token_next(t))
+		fprintf(fh, "(%s)%s", get_token_name(t->type), t->buf);
+	fprintf(fh, "\n");
+}
 
-		nsbl = sibling_next(nsbl);
-		ntkn = token_next(ntkn);
-	} while (nsbl == ntkn);
-	printf("\n");
+void token_free(document_t *document, token_t *token)
+{
+	/* see new_token() in asm.l */
+	document_mem_freed(document, sizeof(*token) + token->length +
+			   (token->txt - token->buf) + 2);
+	free(token);
 }
 
-void link_token(document_t *document, token_t *token)
+static inline
+int token_is_separator(token_t *token)
 {
 	switch (token->type) {
 	case NEWLINE:
 	case COMMENT:
 	case SEMICOLON:
-		break;
+		return 1;
 	default:
-		list_append(&document->statement_tokens, &token->siblings);
-		break;
+		return 0;
 	}
 }
 
+void link_token(document_t *document, token_t *token)
+{
+	if (token_is_separator(token))
+		return;
+
+	if (!document->nstatement_tokens)
+		document->statement_tokens = token;
+	document->nstatement_tokens++;
+}
+
+/* Chunk documents start with a placeholder section standing for whatever
+ * the previous chunk left behind.  Mark the chunk as tainted if the parser
+ * ever looks at it, so the chunk gets reparsed sequentially. */
+static inline
+void chunk_check_section(document_t *document, section_t *section)
+{
+	if (section != NULL && section == document->chunk_entry)
+		document->chunk_tainted = 1;
+}
+
 /* Statement code */
 
-statement_t *statement_new(document_t *document, token_t *token, token_t *lookahead)
+static
+statement_t *statement_alloc(document_t *document, token_t *lookahead)
 {
 	statement_t *stmt;
-	token_t *token_first, *token_last;
-	const char *str;
-	size_t length;
+	token_t *token_last;
 
-	stmt = malloc(sizeof(*stmt));
-	if (stmt == NULL)
-		abort();
+	stmt = document_alloc(document, sizeof(*stmt));
 
-	/* link tokens */
-	list_init(&stmt->tokens);
-	list_del(&document->statement_tokens);
+	/* the tokens linked since the previous statement, the lookahead
+	 * is the last one linked and belongs to the next statement */
+	stmt->tokens = document->statement_tokens;
+	stmt->ntokens = document->nstatement_tokens;
+	stmt->skipped = 0;
+	stmt->id = document->nstatements++;
+	document->nstatement_tokens = 0;
 	if (lookahead) {
-		/* FIXME(pboldin): sad hack to remove lookahead from the
-		 * siblings list.  Either this or manually linking all the
-		 * tokens (which how it was actually and maybe this was better,
-		 * but deemed to be too complex)
-		 */
-		list_del(&lookahead->siblings);
 		link_token(document, lookahead);
+		stmt->ntokens -= document->nstatement_tokens;
 	}
-	list_append(&stmt->tokens, &token->siblings);
 
-	/* Init str */
-	token_first = statement_first_token(stmt);
 	token_last = statement_last_token(stmt);
-
-	str = document->content + token_first->offset;
-	length = token_last->offset + token_last->length - token_first->offset;
-	stmt->str = strndup(str, length);
+	stmt->offset = stmt->tokens->offset;
+	stmt->text = document->content + stmt->offset;
+	stmt->length = token_last->offset + token_last->length -
+		       stmt->tokens->offset;
 
 	/* link statement */
 	list_init(&stmt->list);
 	list_append(&document->statements, &stmt->list);
 
-	/* prepare symbol list */
-	list_init(&stmt->symbol);
+	return stmt;
+}
+
+/* Extends the last range of the section or starts a new one */
+static
+void section_index_statement(document_t *document, section_t *section,
+			     statement_t *stmt)
+{
+	struct stmt_range *last = section->ranges + section->nranges;
+	size_t start = stmt->offset;
+
+	if (section->nranges && last[-1].first->id + last[-1].n == stmt->id)
+		last[-1].n++;
+	else
+		section_add_range(document, section, stmt, 1);
+
+	if (section->nstatements++ == 0)
+		section->start = start;
+	section->end = start + stmt->length;
+	section->bytes += stmt->length;
+}
+
+statement_t *statement_new(document_t *document, token_t *lookahead)
+{
+	statement_t *stmt;
+
+	stmt = statement_alloc(document, lookahead);
+
+	if (document->section) {
+		chunk_check_section(document, document->section);
+		section_index_statement(document, document->section, stmt);
+	}
 
 	return stmt;
 }
 
-void statement_free(statement_t *stmt)
+/* Error recovery dropped the tokens since the previous statement, keep them
+ * as a statement marked skipped and match the diagnostics with it */
+void document_skip_statement(document_t *document, token_t *lookahead)
+{
+	statement_t *stmt = NULL;
+	unsigned int n = document->nstatement_tokens;
+	int i;
+
+	if (lookahead && !token_is_separator(lookahead))
+		n--;
+
+	if (n) {
+		/* belongs to no section either */
+		stmt = statement_alloc(document, lookahead);
+		stmt->skipped = 1;
+	} else {
+		document->nstatement_tokens = 0;
+		if (lookahead)
+			link_token(document, lookahead);
+	}
+
+	for (i = document->diags_skipped; i < document->ndiags; i++)
+		document->diags[i].stmt = stmt;
+	document->diags_skipped = document->ndiags;
+}
+
+void statement_free(document_t *document, statement_t *stmt)
 {
-	free((void *)stmt->str);
+	document_mem_freed(document, sizeof(*stmt));
 	free(stmt);
 }
 
-void statement_print(statement_t *stmt, const char *prefix)
+void statement_print(document_t *document, FILE *fh, statement_t *stmt,
+		     const char *prefix)
 {
 	if (stmt == NULL)
 		return;
-	print_tokens(list_first_entry(&stmt->tokens, token_t, siblings), prefix);
+	if (stmt->tokens == NULL) {
+		/* tokens were dropped */
+		fprintf(fh, "%s%.*s\n", prefix ? prefix : "",
+			(int)stmt->length, stmt->text);
+		return;
+	}
+	print_tokens(document, fh, stmt->tokens, stmt->ntokens, prefix);
+}
+
+/* Statement vectors */
+
+void stmt_vec_append(document_t *document, struct stmt_vec *vec,
+		     statement_t *stmt)
+{
+	statement_t **items;
+	unsigned int alloc;
+
+	if (vec->n == (vec->alloc ? vec->alloc : STMT_VEC_INLINE)) {
+		alloc = vec->n * 2;
+		if (vec->alloc) {
+			items = realloc(vec->items, sizeof(*items) * alloc);
+			if (items == NULL)
+				abort();
+			document_mem_alloced(document,
+					     sizeof(*items) * vec->alloc);
+		} else {
+			items = document_alloc(document, sizeof(*items) * alloc);
+			memcpy(items, vec->inline_items,
+			       sizeof(vec->inline_items));
+		}
+		vec->items = items;
+		vec->alloc = alloc;
+	}
+
+	stmt_vec_items(vec)[vec->n++] = stmt;
+}
+
+/* Appends statements of @from to @vec, leaving @from empty */
+void stmt_vec_splice(document_t *document, struct stmt_vec *vec,
+		     struct stmt_vec *from)
+{
+	statement_t *stmt;
+	unsigned int i;
+
+	stmt_vec_for_each(stmt, i, from)
+		stmt_vec_append(document, vec, stmt);
+
+	stmt_vec_free(document, from);
+}
+
+void stmt_vec_free(document_t *document, struct stmt_vec *vec)
+{
+	if (vec->alloc) {
+		document_mem_freed(document, sizeof(*vec->items) * vec->alloc);
+		free(vec->items);
+	}
+	memset(vec, 0, sizeof(*vec));
 }
 
 void document_symbol_add_statement(document_t *document, statement_t *stmt)
 {
 	struct symbol *s = document->current_symbol;
 
+	if (document->lazy_symbols) {
+		if (document->current_name)
+			document_symbol_event(document, document->current_name,
+					      stmt, 0, 0);
+		return;
+	}
+
 	if (s == NULL)
 		return;
-	list_append(&s->statements, &stmt->symbol);
+	stmt_vec_append(document, &s->statements, stmt);
 }
 
 void document_section_add_statement(document_t *document, statement_t *stmt)
@@ -132,91 +450,217 @@ void document_section_add_statement(document_t *document, statement_t *stmt)
 
 	if (section == NULL)
 		return;
-	list_append(&section->statements, &stmt->symbol);
+	chunk_check_section(document, section);
+	stmt_vec_append(document, &section->statements, stmt);
 }
 
 token_t *statement_last_token(statement_t *stmt)
 {
-	if (list_empty(&stmt->tokens))
-		return NULL;
+	token_t *token, *last = NULL;
+
+	statement_for_each_token(token, stmt)
+		last = token;
 
-	return list_last_entry(&stmt->tokens, token_t, siblings);
+	return last;
 }
 
 token_t *statement_first_token(statement_t *stmt)
 {
-	if (list_empty(&stmt->tokens))
-		return NULL;
-
-	return list_first_entry(&stmt->tokens, token_t, siblings);
+	return stmt->tokens;
 }
 
 /* Symbol code */
 
+#define SYMBOL_KEY_BYTES	sizeof(unsigned long long)
+
+/* First bytes of the name, big-endian and zero padded, so that comparing keys
+ * compares these the way strcmp() does */
+static inline
+unsigned long long symbol_key(const char *name)
+{
+	unsigned long long key = 0;
+	unsigned int i;
+
+	for (i = 0; i < SYMBOL_KEY_BYTES && name[i]; i++)
+		key |= (unsigned long long)(unsigned char)name[i] <<
+		       (8 * (SYMBOL_KEY_BYTES - 1 - i));
+
+	return key;
+}
+
+/* strcmp(name, s->name) with @key = symbol_key(name) */
+static inline
+int symbol_key_cmp(unsigned long long key, const char *name, struct symbol *s)
+{
+	if (key != s->key)
+		return key < s->key ? -1 : 1;
+
+	/* both names end within the key */
+	if (!(key & 0xff))
+		return 0;
+
+	return strcmp(name + SYMBOL_KEY_BYTES, s->name + SYMBOL_KEY_BYTES);
+}
+
 static
-struct symbol *symbol_new(const char *name, section_t *section)
+struct symbol *symbol_new(document_t *document, const char *name,
+			  section_t *section)
 {
+	size_t length = strlen(name);
 	struct symbol *h;
 
-	h = (struct symbol *)malloc(sizeof(*h));
-	if (h == NULL)
-		abort();
+	h = document_alloc(document, sizeof(*h) + length + 1);
 
 	memset((void *)h, 0, sizeof(*h));
 
-	list_init(&h->statements);
-	h->name = strdup(name);
-	if (h->name == NULL)
-		abort();
+	memcpy(h->name, name, length + 1);
 
 	h->section = section;
 	h->next = NULL;
+	h->key = symbol_key(name);
 
 	return h;
 }
 
-static
-void symbol_free(struct symbol *symbol)
+/* Sets the aux statement of the SYMBOL_AUX_* kind @aux, making room for it
+ * among the others if it was not set yet */
+void symbol_set_aux(document_t *document, struct symbol *s, int aux,
+		    statement_t *stmt)
+{
+	unsigned int n = __builtin_popcount(s->aux_mask), i;
+	statement_t **items;
+
+	i = __builtin_popcount(s->aux_mask & ((1u << aux) - 1));
+	if (s->aux_mask & (1u << aux)) {
+		symbol_aux_items(s)[i] = stmt;
+		return;
+	}
+
+	if (n + 1 > SYMBOL_AUX_INLINE) {
+		items = malloc(sizeof(*items) * (n + 1));
+		if (items == NULL)
+			abort();
+		document_mem_alloced(document, sizeof(*items) * (n + 1));
+		memcpy(items, symbol_aux_items(s), sizeof(*items) * n);
+		if (n > SYMBOL_AUX_INLINE) {
+			document_mem_freed(document, sizeof(*items) * n);
+			free(s->aux);
+		}
+		s->aux = items;
+	} else
+		items = s->aux_inline;
+
+	memmove(items + i + 1, items + i, sizeof(*items) * (n - i));
+	items[i] = stmt;
+	s->aux_mask |= 1u << aux;
+}
+
+void symbol_free(document_t *document, struct symbol *symbol)
 {
-	free((void *)symbol->name);
+	unsigned int n = __builtin_popcount(symbol->aux_mask);
+
+	if (n > SYMBOL_AUX_INLINE) {
+		document_mem_freed(document, sizeof(*symbol->aux) * n);
+		free(symbol->aux);
+	}
+	if (symbol->body)
+		symbol_body_put(symbol->body);
+	stmt_vec_free(document, &symbol->statements);
+	document_mem_freed(document, sizeof(*symbol) +
+			   strlen(symbol->name) + 1);
 	free(symbol);
 }
 
-struct symbol *document_find_symbol(document_t *document, const char *name)
+/* Open-coded rb_search_node() to skip the comparison callback */
+static
+struct symbol *symbol_lookup(document_t *document, const char *name)
 {
-	struct rb_node *n;
-	if (rb_empty(&document->symbols))
-		return NULL;
+	unsigned long long key = symbol_key(name);
+	struct rb_node *n = document->symbols.rb_node;
+	struct symbol *s;
+	int rv;
 
-	n = rb_search_node(&document->symbols, (unsigned long)name);
-	if (n)
-		return rb_symbol_entry(n);
+	while (n) {
+		s = rb_symbol_entry(n);
+		rv = symbol_key_cmp(key, name, s);
+		if (rv < 0)
+			n = n->rb_left;
+		else if (rv > 0)
+			n = n->rb_right;
+		else
+			return s;
+	}
 
 	return NULL;
 }
 
-struct symbol *document_get_symbol(document_t *document, const char *name)
+/* Returns the symbol with the same name if there is one, like
+ * rb_insert_node() */
+struct symbol *document_insert_symbol(document_t *document, struct symbol *s)
+{
+	struct rb_node **link = &document->symbols.rb_node, *parent = NULL;
+	struct symbol *p;
+	int rv;
+
+	while (*link) {
+		parent = *link;
+		p = rb_symbol_entry(parent);
+		rv = symbol_key_cmp(s->key, s->name, p);
+		if (rv < 0)
+			link = &parent->rb_left;
+		else if (rv > 0)
+			link = &parent->rb_right;
+		else
+			return p;
+	}
+
+	rb_link_node(&s->node, parent, link);
+	rb_insert_color(&s->node, &document->symbols);
+
+	return NULL;
+}
+
+struct symbol *document_find_symbol(document_t *document, const char *name)
 {
-	struct symbol *h = document->symbols_lru, *p = NULL;
+	document_resolve_symbols(document);
 
-	while (h != NULL) {
-		if (!strcmp(h->name, name)) {
-			if (p)
-				p->next = h->next;
-			goto link;
-		}
+	return symbol_lookup(document, name);
+}
 
-		p = h;
-		h = h->next;
+struct symbol *document_symbols(document_t *document)
+{
+	document_resolve_symbols(document);
+
+	return document->symbols_lru;
+}
+
+/* The symbols are in the tree as soon as these are created, the LRU is
+ * doubly linked to move one to its front */
+struct symbol *document_get_symbol(document_t *document, const char *name)
+{
+	struct symbol *h;
+
+	h = symbol_lookup(document, name);
+	if (h == document->symbols_lru && h)
+		return h;
+
+	if (h) {
+		h->prev->next = h->next;
+		if (h->next)
+			h->next->prev = h->prev;
+	} else {
+		chunk_check_section(document, document->section);
+		h = symbol_new(document, name, document->section);
+		document_insert_symbol(document, h);
 	}
 
-	h = symbol_new(name, document->section);
-link:
-	if (h != document->symbols_lru)
-		h->next = document->symbols_lru;
+	h->prev = NULL;
+	h->next = document->symbols_lru;
+	if (h->next)
+		h->next->prev = h;
 	document->symbols_lru = h;
 
-	return document->symbols_lru;
+	return h;
 }
 
 struct symbol *document_set_symbol(document_t *document, const char *name)
@@ -234,11 +678,19 @@ symbol_set_type(document_t *document, const char *name,
 		statement_t *stmt, token_t *type)
 {
 	struct symbol *s;
+	int stt;
+
+	stt = strcmp(type->txt + 1, "function") == 0 ? STT_FUNC : STT_OBJECT;
+	if (document->lazy_symbols) {
+		document_symbol_event(document, name, stmt,
+				      SYMBOL_HAS(type), stt);
+		return;
+	}
 
 	s = document_get_symbol(document, name);
-	s->aux.type = stmt;
-	s->type = strcmp(type->txt + 1, "function") == 0 ? STT_FUNC : STT_OBJECT;
-	list_append(&s->statements, &stmt->symbol);
+	symbol_set_aux(document, s, SYMBOL_AUX_type, stmt);
+	s->type = stt;
+	stmt_vec_append(document, &s->statements, stmt);
 }
 
 void
@@ -246,15 +698,184 @@ symbol_set_label(document_t *document, const char *name, statement_t *stmt)
 {
 	struct symbol *s;
 
+	chunk_check_section(document, document->section);
 	if (name[0] == '.' && !is_data_sect(document->section)) {
-		/* .Lnum label inside a function */
+		/* .Lnum label inside a function.  An earlier chunk might have
+		 * made the section executable, see chunk_merge_conflicts() */
+		if (document->chunk_entry)
+			document->section->chunk_labels_checked = 1;
 		document_symbol_add_statement(document, stmt);
 		return;
 	}
 
+	if (document->lazy_symbols) {
+		document->current_name = name;
+		document_symbol_event(document, name, stmt,
+				      SYMBOL_HAS(label), 0);
+		return;
+	}
+
 	s = document_set_symbol(document, name);
-	s->aux.label = stmt;
-	list_append(&s->statements, &stmt->symbol);
+	symbol_set_aux(document, s, SYMBOL_AUX_label, stmt);
+	stmt_vec_append(document, &s->statements, stmt);
+}
+
+/* Lazy symbols */
+
+struct symbol_event *symbol_event_new(document_t *document)
+{
+	struct symbol_event *ev;
+	size_t alloc = document->symbol_events_alloc;
+
+	if (document->nsymbol_events == alloc) {
+		document_mem_freed(document, sizeof(*ev) * alloc);
+		alloc = alloc ? alloc * 2 : 256;
+		document->symbol_events = realloc(document->symbol_events,
+						  sizeof(*ev) * alloc);
+		if (document->symbol_events == NULL)
+			abort();
+		document_mem_alloced(document, sizeof(*ev) * alloc);
+		document->symbol_events_alloc = alloc;
+	}
+
+	return &document->symbol_events[document->nsymbol_events++];
+}
+
+void document_symbol_event(document_t *document, const char *name,
+			   statement_t *stmt, unsigned short aux, int type)
+{
+	struct symbol_event *ev;
+
+	/* a symbol created by it goes to the current section */
+	if (aux)
+		chunk_check_section(document, document->section);
+
+	ev = symbol_event_new(document);
+	ev->name = name;
+	ev->stmt = stmt;
+	ev->section = document->section;
+	ev->aux = aux;
+	ev->type = type;
+}
+
+static
+void document_free_symbol_events(document_t *document)
+{
+	document_mem_freed(document, sizeof(*document->symbol_events) *
+			   document->symbol_events_alloc);
+	free(document->symbol_events);
+	document->symbol_events = NULL;
+	document->nsymbol_events = document->symbol_events_alloc = 0;
+}
+
+static
+int symbol_event_cmp(const void *a, const void *b)
+{
+	const struct symbol_event *ea = *(const struct symbol_event **)a;
+	const struct symbol_event *eb = *(const struct symbol_event **)b;
+	int rv = strcmp(ea->name, eb->name);
+
+	/* events of a symbol stay in the order these were recorded in */
+	return rv ? rv : (ea > eb) - (ea < eb);
+}
+
+struct symbol_touch {
+	struct symbol *s;
+	/* last event that would have moved it to the LRU head */
+	size_t last;
+};
+
+static
+int symbol_touch_cmp(const void *a, const void *b)
+{
+	const struct symbol_touch *ta = a, *tb = b;
+
+	return (ta->last < tb->last) - (ta->last > tb->last);
+}
+
+/*
+ * Builds the symbols out of the events recorded in one go: the events are
+ * grouped by the symbol name, each group is applied in order and the LRU is
+ * ordered as if the symbols were looked up while parsing.  Not thread-safe,
+ * a document shared by threads must be resolved before.
+ */
+void document_resolve_symbols(document_t *document)
+{
+	struct symbol_event *events = document->symbol_events, **order, *ev;
+	struct symbol_touch *touched;
+	struct symbol *s, *ns, *head = NULL, **tail = &head;
+	size_t i, j, k, n = document->nsymbol_events, ntouched = 0, last;
+	int created;
+
+	if (n == 0)
+		return;
+
+	order = malloc(sizeof(*order) * n);
+	touched = malloc(sizeof(*touched) * n);
+	if (order == NULL || touched == NULL)
+		abort();
+
+	for (i = 0; i < n; i++)
+		order[i] = &events[i];
+	qsort(order, n, sizeof(*order), symbol_event_cmp);
+
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && !strcmp(order[j]->name, order[i]->name);
+		     j++)
+			;
+
+		s = symbol_lookup(document, order[i]->name);
+		created = s == NULL;
+		if (created) {
+			s = symbol_new(document, order[i]->name,
+				       order[i]->section);
+			document_insert_symbol(document, s);
+		}
+
+		last = created ? (size_t)(order[i] - events) : n;
+		for (k = i; k < j; k++) {
+			ev = order[k];
+			if (ev->aux) {
+				symbol_set_aux(document, s,
+					       __builtin_ctz(ev->aux),
+					       ev->stmt);
+				if (ev->aux == SYMBOL_HAS(type))
+					s->type = ev->type;
+				last = ev - events;
+			}
+			stmt_vec_append(document, &s->statements, ev->stmt);
+		}
+
+		if (last == n)
+			continue;
+		s->merged = 1;
+		touched[ntouched].s = s;
+		touched[ntouched].last = last;
+		ntouched++;
+	}
+
+	/* untouched ones keep their order behind the touched ones */
+	for (s = document->symbols_lru; s; s = ns) {
+		ns = s->next;
+		if (s->merged)
+			continue;
+		*tail = s;
+		tail = &s->next;
+	}
+	*tail = NULL;
+
+	qsort(touched, ntouched, sizeof(*touched), symbol_touch_cmp);
+	for (k = ntouched; k-- > 0; ) {
+		touched[k].s->next = head;
+		touched[k].s->merged = 0;
+		head = touched[k].s;
+	}
+	document->symbols_lru = head;
+	symbols_lru_link(head);
+
+	free(touched);
+	free(order);
+	document->nsymbol_events = 0;
 }
 
 static
@@ -272,39 +893,71 @@ const char *symtype2str(int type)
 	}
 }
 
-void symbol_print(struct symbol *s)
+void symbol_print(document_t *document, FILE *fh, struct symbol *s)
 {
 	statement_t *stmt;
+	unsigned int i;
 
-	printf("symbol: name = %s, type = %s\n", s->name, symtype2str(s->type));
+	fprintf(fh, "symbol: name = %s, type = %s\n", s->name,
+		symtype2str(s->type));
 	if (s->section)
-		printf("symbol: section = %s\n", s->section->name);
-	statement_print(s->aux.label, "symbol: label = ");
-	statement_print(s->aux.type, "symbol: type = ");
-	statement_print(s->aux.globl_or_local, "symbol: globl_or_local = ");
-	statement_print(s->aux.comm, "symbol: comm = ");
-	statement_print(s->aux.weak, "symbol: weak = ");
-	statement_print(s->aux.hidden, "symbol: hidden = ");
-	statement_print(s->aux.protected, "symbol: protected = ");
-	statement_print(s->aux.internal, "symbol: internal = ");
-	statement_print(s->aux.size, "symbol: size = ");
-
-	list_for_each_entry(stmt, &s->statements, symbol) {
-		statement_print(stmt, "");
+		fprintf(fh, "symbol: section = %s\n", s->section->name);
+#define SYMBOL_AUX_PRINT(name, printed, setter)				\
+	if (printed)							\
+		statement_print(document, fh, symbol_aux(s, name),	\
+				"symbol: " #name " = ");
+	SYMBOL_AUX(SYMBOL_AUX_PRINT)
+#undef SYMBOL_AUX_PRINT
+
+	symbol_for_each_statement(stmt, i, s) {
+		statement_print(document, fh, stmt, "");
 	}
 }
 
+/* Ascending by name, rb_first() is the first symbol in strcmp() order.  The
+ * document looks symbols up with symbol_lookup() instead */
 static
 int symbol_cmp_func(struct rb_node *node, unsigned long key)
 {
-	return strcmp(rb_symbol_entry(node)->name,
-		      (char *)key);
+	return symbol_key_cmp(symbol_key((char *)key), (char *)key,
+			      rb_symbol_entry(node));
 }
 
-static
-void symbol_free_node_func(struct rb_node *node)
+/* Ordered symbol index */
+
+struct symbol *document_first_symbol(document_t *document)
 {
-	symbol_free(rb_symbol_entry(node));
+	document_resolve_symbols(document);
+
+	return rb_entry_safe(rb_first(&document->symbols), struct symbol,
+			     node);
+}
+
+struct symbol *symbol_next(struct symbol *s)
+{
+	return rb_entry_safe(rb_next(&s->node), struct symbol, node);
+}
+
+/* The first symbol not less than @name */
+struct symbol *document_lower_bound_symbol(document_t *document,
+					   const char *name)
+{
+	unsigned long long key = symbol_key(name);
+	struct rb_node *n, *found = NULL;
+
+	document_resolve_symbols(document);
+
+	n = document->symbols.rb_node;
+	while (n) {
+		if (symbol_key_cmp(key, name, rb_symbol_entry(n)) <= 0) {
+			found = n;
+			n = n->rb_left;
+		} else {
+			n = n->rb_right;
+		}
+	}
+
+	return rb_entry_safe(found, struct symbol, node);
 }
 
 
@@ -314,18 +967,16 @@ static inline
 void reset_symbols(document_t *document)
 {
 	document->current_symbol = NULL;
+	document->current_name = NULL;
 }
 
-static
-section_t *section_new(const char *name)
+section_t *section_new(document_t *document, const char *name)
 {
 	section_t *h;
 
-	h = malloc(sizeof(*h));
-	if (h == NULL)
-		abort();
+	h = document_alloc(document, sizeof(*h));
 
-	h->name = strdup(name);
+	h->name = document_strndup(document, name, strlen(name));
 
 	h->type = 0;
 	if (STREQ(name, ".text"))
@@ -333,19 +984,61 @@ section_t *section_new(const char *name)
 
 	memset(&h->args, 0, sizeof(h->args));
 	h->next = NULL;
-	list_init(&h->statements);
+	memset(&h->statements, 0, sizeof(h->statements));
+	h->ranges = NULL;
+	h->nranges = h->ranges_alloc = 0;
+	h->nstatements = 0;
+	h->start = h->end = h->bytes = 0;
+	h->chunk_labels_checked = 0;
 
 	return h;
 }
 
-static
-void section_free(section_t *section)
+void section_add_range(document_t *document, section_t *section,
+		       statement_t *first, unsigned int n)
+{
+	size_t alloc = section->ranges_alloc;
+
+	if (section->nranges == alloc) {
+		document_mem_freed(document, sizeof(*section->ranges) * alloc);
+		alloc = alloc ? alloc * 2 : 4;
+		section->ranges = realloc(section->ranges,
+					  sizeof(*section->ranges) * alloc);
+		if (section->ranges == NULL)
+			abort();
+		document_mem_alloced(document,
+				     sizeof(*section->ranges) * alloc);
+		section->ranges_alloc = alloc;
+	}
+
+	section->ranges[section->nranges].first = first;
+	section->ranges[section->nranges].n = n;
+	section->nranges++;
+}
+
+void section_free(document_t *document, section_t *section)
 {
-	free((void *)section->name);
+	document_mem_freed(document,
+			   sizeof(*section->ranges) * section->ranges_alloc);
+	free(section->ranges);
+	stmt_vec_free(document, &section->statements);
+	document_free_str(document, section->name);
+	document_mem_freed(document, sizeof(*section));
 	free(section);
 }
 
-static
+/* Unlike document_get_section() leaves the order of the sections alone */
+section_t *document_find_section(document_t *document, const char *name)
+{
+	section_t *h;
+
+	for (h = document->sections; h; h = h->next)
+		if (!strcmp(h->name, name))
+			return h;
+
+	return NULL;
+}
+
 section_t *document_get_section(document_t *document, const char *name)
 {
 	section_t *h = document->sections, *p = NULL;
@@ -361,7 +1054,7 @@ section_t *document_get_section(document_t *document, const char *name)
 		h = h->next;
 	}
 
-	h = section_new(name);
+	h = section_new(document, name);
 link:
 	if (h != document->sections)
 		h->next = document->sections;
@@ -396,6 +1089,7 @@ void document_pop_section(document_t *document)
 {
 	section_t *s = document->section->next;
 
+	chunk_check_section(document, s);
 	document->section = s;
 
 	reset_symbols(document);
@@ -407,6 +1101,7 @@ void document_previous_section(document_t *document)
 
 	document->section = document->prev_section;
 	document->prev_section = s;
+	chunk_check_section(document, document->section);
 
 	reset_symbols(document);
 }
@@ -421,20 +1116,30 @@ const char *secflags2str(int type)
 	return "";
 }
 
-void section_print(section_t *section)
+void section_print(document_t *document, FILE *fh, section_t *section)
 {
 	statement_t *stmt;
+	unsigned int i;
 
-	printf("section: name = %s, flags = %s\n", section->name, secflags2str(section->type));
-	list_for_each_entry(stmt, &section->statements, symbol) {
-		statement_print(stmt, "");
+	fprintf(fh, "section: name = %s, flags = %s\n", section->name,
+		secflags2str(section->type));
+	section_for_each_statement(stmt, i, section) {
+		statement_print(document, fh, stmt, "");
 	}
 }
 
+void section_print_summary(FILE *fh, section_t *section)
+{
+	fprintf(fh, "section: name = %s, flags = %s, statements = %u, "
+		"bytes = %zu, span = %zu-%zu\n", section->name,
+		secflags2str(section->type), section->nstatements,
+		section->bytes, section->start, section->end);
+}
+
 /* Document code */
 
 document_t *
-document_new(void)
+document_new_mem(struct mem_stats *mem)
 {
 	document_t *document;
 
@@ -442,19 +1147,42 @@ document_new(void)
 	if (document == NULL)
 		abort();
 
+	memset(&document->mem_own, 0, sizeof(document->mem_own));
+	document->mem = mem ? mem : &document->mem_own;
+	document_mem_alloced(document, sizeof(*document));
+
 	list_init(&document->statements);
+	document->nstatements = 0;
 	list_init(&document->tokens);
-	list_init(&document->statement_tokens);
+	document->statement_tokens = NULL;
+	document->nstatement_tokens = 0;
+	document->diags = NULL;
+	document->ndiags = document->diags_alloc = document->diags_skipped = 0;
+	document->text_pool = NULL;
+	document->text_pool_size = 0;
+	document->lines = NULL;
+	document->nlines = 0;
+	document->line_blocks = NULL;
+	document->nline_blocks = 0;
 
 	document->section = document->prev_section = NULL;
 	document->sections = NULL;
 	document->symbols_lru = NULL;
+	document->lazy_symbols = 0;
+	document->symbol_events = NULL;
+	document->nsymbol_events = document->symbol_events_alloc = 0;
 
 	document->spclen = document->offset = 0;
+	document->pipe = NULL;
+
+	document->chunk_entry = NULL;
+	document->chunk_tainted = 0;
 
+	/* no rb_destroy(), the symbols are freed through the LRU so that
+	 * these are accounted, see document_free() */
 	rb_init(&document->symbols,
 		symbol_cmp_func,
-		symbol_free_node_func);
+		NULL);
 
 	reset_symbols(document);
 
@@ -463,6 +1191,12 @@ document_new(void)
 	return document;
 }
 
+document_t *
+document_new(void)
+{
+	return document_new_mem(NULL);
+}
+
 void document_print(document_t *document)
 {
 	document_print_statements(document);
@@ -472,30 +1206,9 @@ void document_print(document_t *document)
 
 void document_print_dbgfilter(document_t *document)
 {
-	token_t *token;
-	int newline = 1, dbgsection = 0;
-
-	list_for_each_entry(token, &document->tokens, list) {
-		if (token->type == DIRECTIVE_SECTION ||
-		    token->type == DIRECTIVE_PUSHSECTION) {
-			/* FIXME(pboldin) account for POPSECTION */
-			dbgsection = !strncmp(
-				token_next(token)->txt,
-				".debug", 6);
-		}
-		if (newline &&
-		    token->type != DIRECTIVE_IDENT &&
-		    (token->type == DIRECTIVE_CFI_IGNORED ||
-		     token->type == DIRECTIVE_LOC_IGNORED ||
-		     dbgsection)) {
-			printf("# ");
-		}
-		if (token->type == LABEL || token->type == LLABEL)
-			printf("%s:", token->buf);
-		else
-			printf("%s", token->buf);
-		newline = token->type == NEWLINE;
-	}
+	/* see emit.c, it writes past stdio */
+	fflush(stdout);
+	document_emit(document, fileno(stdout), DOCUMENT_EMIT_DBGFILTER);
 }
 
 void document_print_statements(document_t *document)
@@ -503,76 +1216,318 @@ void document_print_statements(document_t *document)
 	statement_t *stmt;
 
 	list_for_each_entry(stmt, &document->statements, list) {
-		statement_print(stmt, NULL);
+		statement_print(document, stdout, stmt, NULL);
 	}
 }
 
 void document_print_symbols(document_t *document)
 {
-	struct symbol *h = document->symbols_lru;
+	struct symbol *h;
 	section_t *section = document->sections;
-	while (h) {
-		symbol_print(h);
-		h = h->next;
-	}
+
+	document_for_each_symbol(h, document)
+		symbol_print(document, stdout, h);
 
 	while (section) {
-		section_print(section);
+		section_print(document, stdout, section);
 		section = section->next;
 	}
 }
 
-static void
-_document_update_structs(document_t *document)
+/* Same as document_print_symbols() but in the order of symbol names */
+void document_print_symbols_sorted(document_t *document)
+{
+	struct symbol *h;
+	section_t *section;
+
+	document_for_each_symbol_sorted(h, document)
+		symbol_print(document, stdout, h);
+
+	for (section = document->sections; section; section = section->next)
+		section_print(document, stdout, section);
+}
+
+void document_update_structs(document_t *document)
 {
 	struct symbol *symbol = document->symbols_lru;
 
 	while (symbol) {
-		rb_insert_node(&document->symbols, &symbol->node,
-			       (unsigned long)symbol->name);
+		document_insert_symbol(document, symbol);
 		symbol = symbol->next;
 	}
 
 	return;
 }
 
-document_t *document_parse_content(const char *content,
-				   size_t size)
+void document_add_diagnostic(document_t *document, size_t offset,
+			     size_t line_offset, const char *msg)
 {
-	document_t *document;
+	struct diagnostic *diag;
+
+	if (document->ndiags == document->diags_alloc) {
+		document_mem_freed(document, sizeof(*diag) * document->diags_alloc);
+		document->diags_alloc = document->diags_alloc ?
+					document->diags_alloc * 2 : 16;
+		document->diags = realloc(document->diags, sizeof(*diag) *
+					  document->diags_alloc);
+		if (document->diags == NULL)
+			abort();
+		document_mem_alloced(document,
+				     sizeof(*diag) * document->diags_alloc);
+	}
+
+	diag = &document->diags[document->ndiags++];
+	diag->offset = offset;
+	diag->line_offset = line_offset;
+	diag->msg = document_strndup(document, msg, strlen(msg));
+	diag->stmt = NULL;
+}
+
+void document_print_diagnostics(document_t *document, FILE *fh,
+				const char *path)
+{
+	struct diagnostic *diag;
+	int i;
+
+	for (i = 0; i < document->ndiags; i++) {
+		diag = &document->diags[i];
+		fprintf(fh, "%s:l%d: offset %zu: %s%s\n", path,
+			document_lineno(document, diag->line_offset),
+			diag->offset, diag->msg,
+			diag->stmt ? ", statement skipped" : "");
+	}
+}
+
+static
+void document_free_diagnostics(document_t *document)
+{
+	int i;
+
+	for (i = 0; i < document->ndiags; i++)
+		document_free_str(document, document->diags[i].msg);
+
+	document_mem_freed(document,
+			   sizeof(*document->diags) * document->diags_alloc);
+	free(document->diags);
+	document->diags = NULL;
+	document->ndiags = document->diags_alloc = 0;
+}
+
+void document_report_budget(document_t *document)
+{
+	if (document_over_budget(document))
+		fprintf(stderr, "memory budget of %zu bytes exceeded\n",
+			document->mem->budget);
+}
+
+struct parse_ctx {
 	yyscan_t scanner;
+};
+
+/* Largest content scanned from a single flex buffer */
+#ifndef DOCUMENT_SCAN_MAX
+#define DOCUMENT_SCAN_MAX	((size_t)INT_MAX - DOCUMENT_PADDING)
+#endif
+
+/* What parse_opts asks for once the document is parsed */
+static
+void document_parse_done(document_t *document, const struct parse_opts *opts)
+{
+	if (opts && opts->store)
+		document_share_bodies(document, opts->store);
+
+	if (opts && opts->drop)
+		document_drop(document, opts->drop);
+}
+
+struct parse_ctx *parse_ctx_new(void)
+{
+	struct parse_ctx *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	if (ctx == NULL)
+		abort();
+
+	if (yylex_init(&ctx->scanner))
+		abort();
+
+	return ctx;
+}
+
+void parse_ctx_free(struct parse_ctx *ctx)
+{
+	yylex_destroy(ctx->scanner);
+	free(ctx);
+}
+
+/* With @in_place the content must be padded, the scanner then works on it
+ * directly, temporarily writing NULs after the tokens.  With @input the
+ * content is read through zinput_read() as it is filled in.  With
+ * @pipelined the scanner runs on another thread */
+static
+int document_parse_scanner(document_t *document, yyscan_t scanner,
+			   size_t offset, size_t size, int in_place,
+			   struct zinput *input, int pipelined)
+{
+	YY_BUFFER_STATE buffer = NULL;
+	struct zinput *plain = NULL;
+	int rv;
+
+	/* flex buffers are sized with an int, feed it bit by bit then */
+	if (input == NULL && size > DOCUMENT_SCAN_MAX)
+		input = plain = zinput_new_plain(document->content + offset,
+						 size);
+
+	document->offset = offset;
+	document->nstatement_tokens = 0;
+	yyset_extra(input, scanner);
+	if (input) {
+		buffer = yy_create_buffer(NULL, YY_BUF_SIZE, scanner);
+		yy_switch_to_buffer(buffer, scanner);
+	} else if (in_place)
+		buffer = yy_scan_buffer((char *)document->content + offset,
+					size + DOCUMENT_PADDING, scanner);
+	if (buffer == NULL)
+		buffer = yy_scan_bytes(document->content + offset, size,
+				       scanner);
+
+	if (pipelined)
+		rv = document_parse_pipelined(document, scanner);
+	else
+		rv = yyparse(scanner, document);
+
+	yy_delete_buffer(buffer, scanner);
+	yyset_extra(NULL, scanner);
+	if (plain)
+		zinput_free_plain(plain);
+
+	if (document_over_budget(document))
+		rv = -1;
+
+	return rv;
+}
+
+int document_parse_range(document_t *document, size_t offset, size_t size)
+{
+	yyscan_t scanner;
+	int rv;
 
 	yylex_init(&scanner);
+	rv = document_parse_scanner(document, scanner, offset, size, 0, NULL,
+				    0);
+	yylex_destroy(scanner);
+
+	return rv;
+}
+
+document_t *document_parse_content_opts(const char *content, size_t size,
+					const struct parse_opts *opts)
+{
+	struct parse_ctx *ctx = opts ? opts->ctx : NULL, own;
+	document_t *document;
+	int rv;
+
+	if (opts && opts->jobs > 1) {
+		document = document_parse_chunks(content, size, opts);
+		goto out;
+	}
 
 	document = document_new();
+	if (opts) {
+		document->mem->budget = opts->mem_budget;
+		document->lazy_symbols = opts->lazy_symbols;
+	}
 
 	document->content = content;
 	document->size = size;
+	document_mem_alloced(document, size);
 
-
-	yy_scan_bytes(content, size, scanner);
-	yyset_lineno(1, scanner);
-
-	if (yyparse(scanner, document))
+	if (ctx == NULL) {
+		ctx = &own;
+		yylex_init(&ctx->scanner);
+	}
+	rv = document_parse_scanner(document, ctx->scanner, 0, size,
+				    opts && opts->padded, NULL,
+				    opts && opts->pipeline);
+	if (ctx == &own)
+		yylex_destroy(ctx->scanner);
+	if (rv)
 		goto err;
 
-	yylex_destroy(scanner);
+	document_update_structs(document);
 
-	_document_update_structs(document);
+out:
+	if (document)
+		document_parse_done(document, opts);
 
 	return document;
 
 err:
+	document_report_budget(document);
 	document_free(document);
-	yylex_destroy(scanner);
 	return NULL;
 }
 
-document_t *document_parse_FILE(FILE *fh)
+/* Parses @content while the helper thread of @input decompresses into it,
+ * see zinput.c.  The document takes the content over even when failing */
+document_t *document_parse_input(char *content, struct zinput *input,
+				 const struct parse_opts *opts)
+{
+	struct parse_ctx *ctx = opts ? opts->ctx : NULL, own;
+	document_t *document;
+	ssize_t size;
+	int rv;
+
+	document = document_new();
+	if (opts) {
+		document->mem->budget = opts->mem_budget;
+		document->lazy_symbols = opts->lazy_symbols;
+	}
+
+	/* the size is only known at the end */
+	document->content = content;
+	document->size = 0;
+
+	if (ctx == NULL) {
+		ctx = &own;
+		yylex_init(&ctx->scanner);
+	}
+	rv = document_parse_scanner(document, ctx->scanner, 0, 0, 0, input,
+				    opts && opts->pipeline);
+	if (ctx == &own)
+		yylex_destroy(ctx->scanner);
+
+	size = zinput_finish(input);
+	if (rv || size < 0) {
+		document_report_budget(document);
+		document_free(document);
+		return NULL;
+	}
+
+	document->size = size;
+	document_mem_alloced(document, size);
+
+	document_update_structs(document);
+	document_parse_done(document, opts);
+
+	return document;
+}
+
+document_t *document_parse_content(const char *content, size_t size)
 {
+	return document_parse_content_opts(content, size, NULL);
+}
+
+document_t *document_parse_FILE_opts(FILE *fh, const struct parse_opts *opts)
+{
+	struct parse_opts padded_opts = { 0 };
 	char *content, *p;
 	size_t size, read, toread;
-	int rv;
+	int rv, format;
+
+	format = zinput_detect(fh);
+	if (format != ZINPUT_NONE)
+		return document_parse_compressed(fh, format, opts);
 
 	rv = fseek(fh, 0, SEEK_END);
 	if (rv < 0)
@@ -580,9 +1535,10 @@ document_t *document_parse_FILE(FILE *fh)
 
 	size = ftell(fh);
 
-	p = content = malloc(size);
+	p = content = malloc(size + DOCUMENT_PADDING);
 	if (content == NULL)
 		return NULL;
+	memset(content + size, 0, DOCUMENT_PADDING);
 
 	rv = fseek(fh, 0, SEEK_SET);
 	if (rv < 0)
@@ -601,7 +1557,11 @@ document_t *document_parse_FILE(FILE *fh)
 	if (p != content + size)
 		goto err_read;
 
-	return document_parse_content(content, size);
+	if (opts)
+		padded_opts = *opts;
+	padded_opts.padded = 1;
+
+	return document_parse_content_opts(content, size, &padded_opts);
 
 err_read:
 	/* TODO save errno */
@@ -609,8 +1569,15 @@ err_read:
 	return NULL;
 }
 
-document_t *document_parse_path(const char *fname)
+document_t *document_parse_FILE(FILE *fh)
 {
+	return document_parse_FILE_opts(fh, NULL);
+}
+
+document_t *document_parse_path_opts(const char *fname,
+				     const struct parse_opts *opts)
+{
+	struct parse_opts named_opts = { 0 };
 	FILE *fh;
 	document_t *document;
 
@@ -618,40 +1585,175 @@ document_t *document_parse_path(const char *fname)
 	if (fh == NULL)
 		return NULL;
 
-	document = document_parse_FILE(fh);
+	if (opts)
+		named_opts = *opts;
+	if (named_opts.name == NULL)
+		named_opts.name = fname;
+	document = document_parse_FILE_opts(fh, &named_opts);
 
 	fclose(fh);
 
 	return document;
 }
 
+document_t *document_parse_path(const char *fname)
+{
+	return document_parse_path_opts(fname, NULL);
+}
+
+/* Text of a symbol body shared with other documents, see dedup.c.  Only
+ * meaningful until the texts are pinned */
+static inline
+int statement_text_shared(document_t *document, statement_t *stmt)
+{
+	return stmt->text &&
+	       !(document->content && stmt->text >= document->content &&
+		 stmt->text <= document->content + document->size);
+}
+
+/* Copies the statement texts out of the content or, once that is dropped,
+ * the tokens, so these survive dropping both */
+static
+void document_pin_text(document_t *document)
+{
+	statement_t *stmt;
+	token_t *token, *last;
+	size_t size = 0;
+	char *p, *q;
+
+	if (list_empty(&document->statements))
+		return;
+
+	list_for_each_entry(stmt, &document->statements, list)
+		if (!statement_text_shared(document, stmt))
+			size += stmt->length;
+
+	p = document->text_pool = document_alloc(document, size);
+	document->text_pool_size = size;
+
+	list_for_each_entry(stmt, &document->statements, list) {
+		if (statement_text_shared(document, stmt))
+			continue;
+		if (stmt->text) {
+			memcpy(p, stmt->text, stmt->length);
+		} else {
+			/* LABEL and LLABEL buffers lack the ':', the
+			 * statement text ends before the last one's */
+			q = p;
+			last = statement_last_token(stmt);
+			statement_for_each_token(token, stmt) {
+				memcpy(q, token->buf, token->length);
+				q += token->length;
+				if ((token->type == LABEL ||
+				     token->type == LLABEL) && token != last)
+					*q++ = ':';
+			}
+		}
+
+		stmt->text = p;
+		p += stmt->length;
+	}
+}
+
+/* Gives the statements their text back once the content is dropped but
+ * the tokens are kept */
+void document_keep_text(document_t *document)
+{
+	if (document->content == NULL && document->text_pool == NULL &&
+	    !list_empty(&document->tokens))
+		document_pin_text(document);
+}
+
+void document_drop(document_t *document, int what)
+{
+	statement_t *stmt;
+	token_t *tkn, *ttkn;
+	int keep_content, keep_tokens;
+
+	/* names of the symbol events point into the tokens */
+	if (what & DOCUMENT_DROP_TOKENS)
+		document_resolve_symbols(document);
+
+	keep_content = document->content && !(what & DOCUMENT_DROP_CONTENT);
+	keep_tokens = !list_empty(&document->tokens) &&
+		      !(what & DOCUMENT_DROP_TOKENS);
+
+	/* statement texts are only needed once there are no tokens */
+	if (!keep_content && !keep_tokens && document->text_pool == NULL)
+		document_pin_text(document);
+
+	if (what & DOCUMENT_DROP_TOKENS) {
+		list_for_each_entry(stmt, &document->statements, list) {
+			stmt->tokens = NULL;
+			stmt->ntokens = 0;
+		}
+
+		list_for_each_entry_safe(tkn, ttkn, &document->tokens, list)
+			token_free(document, tkn);
+
+		list_init(&document->tokens);
+		document->statement_tokens = NULL;
+		document->nstatement_tokens = 0;
+	}
+
+	if ((what & DOCUMENT_DROP_CONTENT) && document->content) {
+		/* the tokens and diagnostics left still have their lines */
+		if (keep_tokens || document->ndiags)
+			document_index_lines(document);
+
+		if (document->text_pool == NULL)
+			list_for_each_entry(stmt, &document->statements, list)
+				if (!statement_text_shared(document, stmt))
+					stmt->text = NULL;
+
+		document_mem_freed(document, document->size);
+		free((void *)document->content);
+		document->content = NULL;
+	}
+}
+
 void document_free(document_t *document)
 {
 	struct symbol *symbol = document->symbols_lru, *nsymbol;
 	struct section *section = document->sections, *nsection;
 	statement_t *stmt, *tstmt;
-	token_t *tkn, *ttkn;
 
 	while (symbol) {
 		nsymbol = symbol->next;
-		symbol_free(symbol);
+		symbol_free(document, symbol);
 		symbol = nsymbol;
 	}
 
 	while (section) {
 		nsection = section->next;
-		section_free(section);
+		section_free(document, section);
 		section = nsection;
 	}
 
-	list_for_each_entry_safe(tkn, ttkn, &document->tokens, list) {
-		free(tkn);
+	list_for_each_entry_safe(stmt, tstmt, &document->statements, list) {
+		statement_free(document, stmt);
 	}
+	list_init(&document->statements);
 
-	list_for_each_entry_safe(stmt, tstmt, &document->statements, list) {
-		statement_free(stmt);
+	document_free_diagnostics(document);
+	document_free_symbol_events(document);
+
+	document_drop(document, DOCUMENT_DROP_TOKENS | DOCUMENT_DROP_CONTENT);
+
+	if (document->text_pool) {
+		document_mem_freed(document, document->text_pool_size);
+		free(document->text_pool);
+	}
+
+	if (document->lines) {
+		document_mem_freed(document,
+				   sizeof(*document->lines) * document->nlines +
+				   sizeof(*document->line_blocks) *
+				   (document->nline_blocks + 1));
+		free(document->line_blocks);
+		free(document->lines);
 	}
 
-	free((void *)document->content);
+	document_mem_freed(document, sizeof(*document));
 	free(document);
 }
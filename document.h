@@ -2,6 +2,8 @@
 #ifndef DOCUMENT_H_INCLUDED
 #define DOCUMENT_H_INCLUDED
 
+#include <string.h>
+
 #include "list.h"
 #include "parse.h"
 #include "rbtree.h"
@@ -10,15 +12,55 @@ typedef struct statement {
 	/* list of the statements, links to document_t->statements */
 	list_t list;
 
-	/* list of statements in symbols */
-	list_t symbol;
+	/* tokens of statement, a run of ntokens in document_t->tokens
+	 * starting at tokens, NULL once the tokens are dropped */
+	token_t *tokens;
+	unsigned int ntokens:31;
+	/* skipped by the error recovery, belongs to no symbol or section */
+	unsigned int skipped:1;
+	/* position in document_t->statements */
+	unsigned int id;
+
+	/* the whole statement content, not NUL-terminated.  Points into
+	 * document_t->content or document_t->text_pool */
+	unsigned int length;
+	/* where the text starts in the content */
+	size_t offset;
+	const char *text;
+} statement_t;
 
-	/* tokens of statement */
-	list_t tokens;
+/* Statements of a symbol or a section, the first few are stored inline */
+#define STMT_VEC_INLINE		4
 
-	/* the whole statement content */
-	const char *str;
-} statement_t;
+struct stmt_vec {
+	/* alloc is 0 while the inline storage is used */
+	unsigned int n, alloc;
+	union {
+		statement_t *inline_items[STMT_VEC_INLINE];
+		statement_t **items;
+	};
+};
+
+static inline
+statement_t **stmt_vec_items(struct stmt_vec *vec)
+{
+	return vec->alloc ? vec->items : vec->inline_items;
+}
+
+#define stmt_vec_for_each(stmt, i, vec)					\
+	for ((i) = 0;							\
+	     (i) < (vec)->n && ((stmt) = stmt_vec_items(vec)[i], 1);	\
+	     (i)++)
+
+/* A run of consecutive statements in the document order */
+struct stmt_range {
+	statement_t *first;
+	unsigned int n;
+};
+
+#define stmt_range_for_each(stmt, i, range)				\
+	for ((i) = 0, (stmt) = (range)->first; (i) < (range)->n;	\
+	     (i)++, (stmt) = document_statement_next(stmt))
 
 typedef struct section section_t;
 
@@ -29,39 +71,112 @@ struct section {
 #define SECTION_KSYTAB		0x2
 	int type;
 
-	list_t statements;
+	/* section directives */
+	struct stmt_vec statements;
+
+	/* all the statements in the section, in the document order */
+	struct stmt_range *ranges;
+	unsigned int nranges, ranges_alloc;
+	/* summary of these: count, content span and bytes covered */
+	unsigned int nstatements;
+	size_t start, end, bytes;
 
 	struct section_args args;
 
+	/* chunk documents: a .L label was taken for a function one since
+	 * the section was not executable, see symbol_set_label() */
+	int chunk_labels_checked;
+
 	section_t *next;
 };
 
-struct symbol {
-	const char *name;
-	int type;
+/* Symbol directives kept aside as the aux statements of the symbol:
+ * X(name, printed by symbol_print(), symbol_set_<name>() generated) */
+#define SYMBOL_AUX(X)							\
+	X(label, 1, 0)							\
+	X(type, 1, 0)							\
+	X(globl_or_local, 1, 1)						\
+	X(comm, 1, 1)							\
+	X(weak, 1, 1)							\
+	X(hidden, 1, 1)							\
+	X(protected, 1, 1)						\
+	X(internal, 1, 1)						\
+	X(size, 1, 1)							\
+	X(set, 0, 1)
+
+enum {
+#define SYMBOL_AUX_ENUM(name, printed, setter)	SYMBOL_AUX_ ## name,
+	SYMBOL_AUX(SYMBOL_AUX_ENUM)
+#undef SYMBOL_AUX_ENUM
+	SYMBOL_AUX_MAX,
+};
 
-	struct {
-		statement_t *type;
-		statement_t *label;
-		statement_t *globl_or_local;
-		statement_t *weak;
-		statement_t *hidden;
-		statement_t *protected;
-		statement_t *internal;
-		statement_t *size;
-		statement_t *comm;
-		statement_t *set;
-	} aux;
+/* Bit of struct symbol.aux_mask, these can be or-ed for symbol_has() */
+#define SYMBOL_HAS(name)	(1u << SYMBOL_AUX_ ## name)
 
-	list_t statements;
+/* aux statements stored inline, more go to an array */
+#define SYMBOL_AUX_INLINE	3
+
+struct symbol {
+	/* aux statements in the SYMBOL_AUX() order, one for each bit of
+	 * aux_mask */
+	union {
+		statement_t *aux_inline[SYMBOL_AUX_INLINE];
+		statement_t **aux;
+	};
+
+	struct stmt_vec statements;
+	/* the texts of the statements shared with other documents */
+	struct symbol_body *body;
 
 	section_t *section;
 
-	/* LRU for parsing */
-	struct symbol *next;
-	/* Tree for search */
+	/* LRU for parsing, most recently used first */
+	struct symbol *next, *prev;
+	/* Tree for search, ordered by the name.  key holds its first bytes
+	 * so that most comparisons do not have to look at the name */
+	unsigned long long key;
 	struct rb_node node;
 #define rb_symbol_entry(n) rb_entry((n), struct symbol, node)
+
+	/* STT_* */
+	unsigned char type;
+	/* scratch mark for merging chunk documents */
+	unsigned char merged;
+	/* SYMBOL_HAS() bits of the aux statements set */
+	unsigned short aux_mask;
+
+	/* allocated along with the symbol */
+	char name[];
+};
+
+/* Symbol directive recorded while parsing with lazy symbols */
+struct symbol_event {
+	/* points at the token text */
+	const char *name;
+	statement_t *stmt;
+	/* current section when recorded, the one a new symbol is in */
+	section_t *section;
+	/* SYMBOL_HAS() bit of the aux statement set, 0 for a plain member
+	 * statement */
+	unsigned short aux;
+	/* STT_* for .type */
+	unsigned short type;
+};
+
+struct diagnostic {
+	/* the line is the one at line_offset, the end of the token */
+	size_t offset, line_offset;
+	/* "unexpected X, expecting Y or Z" */
+	char *msg;
+	/* the statement skipped because of it, if any */
+	statement_t *stmt;
+};
+
+struct mem_stats {
+	size_t used, peak;
+	/* 0 for no limit */
+	size_t budget;
 };
 
 typedef struct document {
@@ -69,17 +184,36 @@ typedef struct document {
 	const char *content;
 	size_t size;
 
+	/* offsets of the newlines in the content, built on demand, see
+	 * document_lineno().  line_blocks[b] is the first one in the block b
+	 * of the content, the offsets are relative to the block */
+	unsigned int *lines;
+	size_t nlines;
+	size_t *line_blocks;
+	size_t nline_blocks;
+
 	/* For tokenizer */
-	int spclen, offset;
+	int spclen;
+	/* the directive RESTLINE is scanned for, see asm.l */
+	int rest_token;
+	size_t offset;
+	/* the lexer runs on another thread, see pipeline.c */
+	struct token_pipe *pipe;
 
 	/* all statements */
 	list_t statements;
+	unsigned int nstatements;
 
 	/* all tokens */
 	list_t tokens;
 
-	/* tokens for current statement */
-	list_t statement_tokens;
+	/* tokens for current statement, a run in tokens */
+	token_t *statement_tokens;
+	unsigned int nstatement_tokens;
+
+	/* statement texts kept once both the content and tokens are dropped */
+	char *text_pool;
+	size_t text_pool_size;
 
 	section_t *section, *prev_section, *sections;
 
@@ -90,63 +224,254 @@ typedef struct document {
 
 	/* LRU with symbols */
 	struct symbol *symbols_lru;
+
+	/* Lazy symbols: symbol directives are only recorded while parsing
+	 * and turned into symbols once these are looked at, see
+	 * document_resolve_symbols() */
+	int lazy_symbols;
+	const char *current_name;
+	struct symbol_event *symbol_events;
+	size_t nsymbol_events, symbol_events_alloc;
+
+	/* syntax errors recovered from, diags_skipped is the first one not
+	 * yet matched with a skipped statement */
+	struct diagnostic *diags;
+	int ndiags, diags_alloc, diags_skipped;
+
+	/* Chunk-parallel parsing: placeholder for the section state inherited
+	 * from the previous chunk, set when it was consulted by the parser */
+	section_t *chunk_entry;
+	int chunk_tainted;
+
+	/* Memory accounting, chunk documents account to the main one */
+	struct mem_stats *mem;
+	struct mem_stats mem_own;
 } document_t;
 
+#define DOCUMENT_DROP_CONTENT	0x1
+#define DOCUMENT_DROP_TOKENS	0x2
+
+/* Zero bytes past the end of the content that let the scanner use it in
+ * place, see parse_opts.padded */
+#define DOCUMENT_PADDING	2
+
+/* Scanner reused by the parses of one thread, see parse_opts.ctx */
+struct parse_ctx;
+struct body_store;
+struct zinput;
+
+struct parse_ctx *parse_ctx_new(void);
+void parse_ctx_free(struct parse_ctx *ctx);
+
+struct parse_opts {
+	/* parse chunks of the content on that many threads, 0 or 1 to parse
+	 * sequentially */
+	int jobs;
+	/* minimal size of a chunk, 0 for the default */
+	size_t chunk_size;
+	/* fail the parse rather than use more memory, 0 for no limit */
+	size_t mem_budget;
+	/* DOCUMENT_DROP_* parts not needed once the parse is done */
+	int drop;
+	/* record symbol directives, build symbols on the first lookup */
+	int lazy_symbols;
+	/* the content is followed by DOCUMENT_PADDING zero bytes, it is
+	 * scanned in place rather than copied */
+	int padded;
+	/* scanner to use for sequential parses rather than a new one */
+	struct parse_ctx *ctx;
+	/* lex on another thread than the one parsing */
+	int pipeline;
+	/* share identical symbol bodies with the other documents parsed
+	 * with the store */
+	struct body_store *store;
+	/* the input in error messages, NULL if it has no name */
+	const char *name;
+	/* do not report a corrupt input, the caller expects it to fail */
+	int quiet;
+};
+
+/* Memory accounting */
+
+void document_mem_alloced(document_t *document, size_t size);
+void document_mem_freed(document_t *document, size_t size);
+void *document_alloc(document_t *document, size_t size);
+char *document_strndup(document_t *document, const char *str, size_t length);
+long mem_peak_rss(void);
+
+static inline
+int document_over_budget(document_t *document)
+{
+	struct mem_stats *mem = document->mem;
+
+	return mem->budget && mem->used > mem->budget;
+}
+
 /* Token functions */
 
-void print_tokens(token_t *t, const char *prefix);
+void print_tokens(document_t *document, FILE *fh, token_t *t, unsigned int n,
+		  const char *prefix);
 void link_token(document_t *document, token_t *token);
+void token_free(document_t *document, token_t *token);
 
 /* Statement functions */
 
-statement_t *statement_new(document_t *, token_t *, token_t *);
+statement_t *statement_new(document_t *, token_t *lookahead);
+void statement_free(document_t *, statement_t *);
+void statement_print(document_t *, FILE *fh, statement_t *,
+		     const char *prefix);
+void document_skip_statement(document_t *, token_t *lookahead);
 void document_symbol_add_statement(document_t *, statement_t *);
 void document_section_add_statement(document_t *, statement_t *);
 token_t *statement_first_token(statement_t *);
 token_t *statement_last_token(statement_t *);
 
-#define statement_for_each_token(tkn, stmt)	\
-	list_for_each_entry(tkn, &stmt->tokens, siblings)
+#define statement_for_each_token(tkn, stmt)				\
+	for (unsigned int _n_ = ((tkn) = (stmt)->tokens, (stmt)->ntokens); \
+	     _n_; _n_--, (tkn) = token_next(tkn))
+
+void stmt_vec_append(document_t *, struct stmt_vec *, statement_t *);
+void stmt_vec_splice(document_t *, struct stmt_vec *, struct stmt_vec *);
+void stmt_vec_free(document_t *, struct stmt_vec *);
 
 /* Symbol functions */
 
 struct symbol *document_find_symbol(document_t *, const char *name);
 struct symbol *document_get_symbol(document_t *, const char *name);
 struct symbol *document_set_symbol(document_t *, const char *name);
+struct symbol *document_insert_symbol(document_t *, struct symbol *);
+struct symbol_event *symbol_event_new(document_t *);
+void document_symbol_event(document_t *, const char *name, statement_t *stmt,
+			   unsigned short aux, int type);
+void document_resolve_symbols(document_t *);
+struct symbol *document_symbols(document_t *);
+
+/* Symbols in the LRU order, resolving the lazy ones first */
+#define document_for_each_symbol(s, document)				\
+	for ((s) = document_symbols(document); (s); (s) = (s)->next)
+
+/* Sets the ->prev links of the LRU rebuilt from @head */
+static inline
+void symbols_lru_link(struct symbol *head)
+{
+	struct symbol *p = NULL;
+
+	for (; head; p = head, head = head->next)
+		head->prev = p;
+}
+
+/* Ordered iteration and queries over the symbols tree */
+struct symbol *document_first_symbol(document_t *);
+struct symbol *document_lower_bound_symbol(document_t *, const char *name);
+struct symbol *symbol_next(struct symbol *);
+
+static inline
+int symbol_has_prefix(struct symbol *s, const char *prefix, size_t length)
+{
+	return !strncmp(s->name, prefix, length);
+}
+
+#define document_for_each_symbol_sorted(s, document)			\
+	for ((s) = document_first_symbol(document); (s);		\
+	     (s) = symbol_next(s))
+
+/* Symbols with names in [@from, @to), @to is NULL for no upper bound */
+#define document_for_each_symbol_range(s, document, from, to)		\
+	for ((s) = document_lower_bound_symbol(document, from);	\
+	     (s) && ((to) == NULL || strcmp((s)->name, (to)) < 0);	\
+	     (s) = symbol_next(s))
+
+#define document_for_each_symbol_prefix(s, document, prefix)		\
+	for (size_t _len_ = ((s) = document_lower_bound_symbol(document,\
+						prefix), strlen(prefix));\
+	     (s) && symbol_has_prefix((s), (prefix), _len_);		\
+	     (s) = symbol_next(s))
 
 void symbol_set_type(document_t *, const char *name,
 		     statement_t *stmt, token_t *type);
 void symbol_set_label(document_t *document, const char *name, statement_t *stmt);
 
 
-#define GENERATE_SYMBOL_SET_(statement_name)				\
+void symbol_set_aux(document_t *, struct symbol *, int aux,
+		    statement_t *stmt);
+
+static inline
+statement_t **symbol_aux_items(struct symbol *s)
+{
+	return __builtin_popcount(s->aux_mask) > SYMBOL_AUX_INLINE ?
+	       s->aux : s->aux_inline;
+}
+
+/* The aux statement of the SYMBOL_AUX_* kind @aux, NULL if not set */
+static inline
+statement_t *symbol_get_aux(struct symbol *s, int aux)
+{
+	if (!(s->aux_mask & (1u << aux)))
+		return NULL;
+	return symbol_aux_items(s)[__builtin_popcount(s->aux_mask &
+						      ((1u << aux) - 1))];
+}
+
+#define symbol_aux(s, name)	symbol_get_aux((s), SYMBOL_AUX_ ## name)
+
+/* All of the SYMBOL_HAS() bits of @mask are set */
+static inline
+int symbol_has(struct symbol *s, unsigned int mask)
+{
+	return (s->aux_mask & mask) == mask;
+}
+
+#define GENERATE_SYMBOL_SET_0(statement_name)
+#define GENERATE_SYMBOL_SET_1(statement_name)				\
 static inline void							\
 symbol_set_ ## statement_name (document_t *document,			\
 			       const char *name, statement_t *stmt)	\
 {									\
-	struct symbol *s = document_get_symbol(document, name);		\
-	s->aux.statement_name = stmt;					\
-	list_append(&s->statements, &stmt->symbol);			\
+	struct symbol *s;						\
+									\
+	if (document->lazy_symbols) {					\
+		document_symbol_event(document, name, stmt,		\
+				      SYMBOL_HAS(statement_name), 0);	\
+		return;							\
+	}								\
+	s = document_get_symbol(document, name);			\
+	symbol_set_aux(document, s, SYMBOL_AUX_ ## statement_name, stmt);\
+	stmt_vec_append(document, &s->statements, stmt);		\
 }
+#define GENERATE_SYMBOL_SET_(statement_name, printed, setter)		\
+	GENERATE_SYMBOL_SET_ ## setter(statement_name)
+
+SYMBOL_AUX(GENERATE_SYMBOL_SET_)
 
-GENERATE_SYMBOL_SET_(globl_or_local);
-GENERATE_SYMBOL_SET_(weak);
-GENERATE_SYMBOL_SET_(hidden);
-GENERATE_SYMBOL_SET_(protected);
-GENERATE_SYMBOL_SET_(internal);
-GENERATE_SYMBOL_SET_(size);
-GENERATE_SYMBOL_SET_(comm);
-GENERATE_SYMBOL_SET_(set);
+void symbol_print(document_t *document, FILE *fh, struct symbol *s);
+void symbol_free(document_t *, struct symbol *symbol);
 
-void symbol_print(struct symbol *s);
+#define symbol_for_each_statement(stmt, i, s)	\
+	stmt_vec_for_each(stmt, i, &(s)->statements)
 
 /* Section functions */
 
+section_t *section_new(document_t *, const char *name);
+void section_free(document_t *, section_t *section);
+section_t *document_find_section(document_t *, const char *);
+section_t *document_get_section(document_t *, const char *);
 section_t *document_set_section(document_t *, const char *);
 void document_previous_section(document_t *);
 void document_pop_section(document_t *);
 
 void section_set_args(section_t *section, struct section_args args);
+void section_print(document_t *document, FILE *fh, section_t *section);
+void section_print_summary(FILE *fh, section_t *section);
+
+#define section_for_each_statement(stmt, i, section)	\
+	stmt_vec_for_each(stmt, i, &(section)->statements)
+
+#define section_for_each_range(range, section)				\
+	for ((range) = (section)->ranges;				\
+	     (range) < (section)->ranges + (section)->nranges; (range)++)
+
+void section_add_range(document_t *, section_t *, statement_t *first,
+		       unsigned int n);
 
 static inline
 section_t *document_set_section_with_args(document_t *document, const char *name,
@@ -169,15 +494,115 @@ int is_data_sect(section_t *section)
 /* Document functions */
 
 document_t *document_new(void);
+document_t *document_new_mem(struct mem_stats *mem);
 document_t *document_parse_path(const char *path);
 document_t *document_parse_FILE(FILE *fh);
 document_t *document_parse_content(const char *content, size_t size);
+document_t *document_parse_path_opts(const char *path,
+				     const struct parse_opts *opts);
+document_t *document_parse_FILE_opts(FILE *fh, const struct parse_opts *opts);
+document_t *document_parse_content_opts(const char *content, size_t size,
+					const struct parse_opts *opts);
+int document_parse_range(document_t *document, size_t offset, size_t size);
+void document_report_budget(document_t *document);
+void document_add_diagnostic(document_t *document, size_t offset,
+			     size_t line_offset, const char *msg);
+int document_lineno(document_t *document, size_t offset);
+long document_line_offset(document_t *document, int lineno);
+void document_print_diagnostics(document_t *document, FILE *fh,
+				const char *path);
+void document_update_structs(document_t *document);
 void document_print(document_t *document);
 void document_free(document_t *document);
+void document_drop(document_t *document, int what);
+void document_keep_text(document_t *document);
 void document_print_dbgfilter(document_t *document);
 void document_print_symbols(document_t *document);
+void document_print_symbols_sorted(document_t *document);
 void document_print_statements(document_t *tree);
 
+/* Chunk-parallel parsing, see chunk.c */
+
+document_t *document_parse_chunks(const char *content, size_t size,
+				  const struct parse_opts *opts);
+
+/* Compressed input, see zinput.c */
+
+enum {
+	ZINPUT_NONE,
+	ZINPUT_GZIP,
+	ZINPUT_ZSTD,
+};
+
+int zinput_format(const void *magic, size_t n);
+int zinput_detect(FILE *fh);
+size_t zinput_read(struct zinput *input, char *buf, size_t max);
+struct zinput *zinput_new_plain(const char *content, size_t size);
+void zinput_free_plain(struct zinput *input);
+ssize_t zinput_finish(struct zinput *input);
+document_t *document_parse_compressed(FILE *fh, int format,
+				      const struct parse_opts *opts);
+document_t *document_parse_input(char *content, struct zinput *input,
+				 const struct parse_opts *opts);
+
+/* Reading files ahead of parsing them, see readahead.c */
+
+struct readahead;
+
+struct readahead *readahead_new(char **paths, size_t n, int window);
+document_t *readahead_parse(struct readahead *ra, size_t i,
+			    const struct parse_opts *opts);
+void readahead_free(struct readahead *ra);
+
+/* Pipelined parsing, see pipeline.c */
+
+int document_parse_pipelined(document_t *document, yyscan_t scanner);
+int token_pipe_next(document_t *document, token_t **token);
+
+/* Symbol bodies shared across documents, see dedup.c */
+
+struct body_store *body_store_new(void);
+void body_store_free(struct body_store *store);
+void body_store_stats(struct body_store *store, size_t *nbodies,
+		      size_t *nrefs, size_t *bytes);
+void document_share_bodies(document_t *document, struct body_store *store);
+void symbol_body_put(struct symbol_body *body);
+int symbol_body_compare(struct symbol *a, struct symbol *b);
+
+/* Span output, see emit.c */
+
+#define DOCUMENT_EMIT_DBGFILTER	0x1
+
+int document_emit(document_t *document, int fd, int flags);
+
+/* Data decoding, see data.c */
+
+/* Operand left to the linker: the bytes at offset are zero in the image,
+ * size is 0 for a LEB128 one */
+struct data_reloc {
+	size_t offset;
+	unsigned int size;
+	unsigned int length;
+	const char *expr;
+};
+
+/* Bytes the data directives of a symbol assemble to */
+struct data_image {
+	unsigned char *bytes;
+	size_t size, alloc;
+	struct data_reloc *relocs;
+	size_t nrelocs, relocs_alloc;
+};
+
+int symbol_decode_data(struct symbol *s, struct data_image *image);
+int statement_is_data(statement_t *stmt);
+void data_image_free(struct data_image *image);
+int data_image_equal(const struct data_image *a, const struct data_image *b);
+unsigned long long data_image_hash(const struct data_image *image);
+void data_image_print(struct symbol *s, const struct data_image *image);
+int statement_data_size(statement_t *stmt, struct data_image *scratch,
+			size_t *psize);
+
 #define document_statement_next(stmt)	\
 	list_entry(stmt->list.next, statement_t, list)
 
@@ -0,0 +1,135 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+
+#include "document.h"
+#include "y.tab.h"
+
+/*
+ * Span output.
+ *
+ * The tokens are consecutive runs of the content, so output that reproduces
+ * most of it, the round trip or the dbgfilter with its "# " prefixes, is
+ * written as slices of the content: the tokens that follow one another are
+ * merged into one slice and only the inserted bytes break these.  The
+ * slices go out with writev() in batches rather than token by token.
+ */
+
+/* slices written at once */
+#define EMIT_IOV	256
+
+struct emitter {
+	int fd, error;
+	struct iovec iov[EMIT_IOV];
+	int n;
+};
+
+static
+void emit_flush(struct emitter *e)
+{
+	struct iovec *iov = e->iov;
+	int n = e->n;
+	ssize_t rv;
+
+	e->n = 0;
+	while (n && !e->error) {
+		rv = writev(e->fd, iov, n);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv < 0) {
+			e->error = errno;
+			break;
+		}
+
+		/* partially written */
+		for (; n && (size_t)rv >= iov->iov_len; iov++, n--)
+			rv -= iov->iov_len;
+		if (n) {
+			iov->iov_base = (char *)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+}
+
+static
+void emit(struct emitter *e, const char *p, size_t n)
+{
+	struct iovec *last;
+
+	if (n == 0)
+		return;
+	last = e->n ? &e->iov[e->n - 1] : NULL;
+	if (last && (char *)last->iov_base + last->iov_len == p) {
+		last->iov_len += n;
+		return;
+	}
+
+	if (e->n == EMIT_IOV)
+		emit_flush(e);
+	e->iov[e->n].iov_base = (void *)p;
+	e->iov[e->n].iov_len = n;
+	e->n++;
+}
+
+/* The token as in the content, the buffers of LABEL and LLABEL lack the
+ * ':' there */
+static
+void emit_token(struct emitter *e, document_t *document, token_t *token)
+{
+	int label = token->type == LABEL || token->type == LLABEL;
+
+	if (document->content &&
+	    token->offset + token->length + label <= document->size) {
+		emit(e, document->content + token->offset,
+		     token->length + label);
+		return;
+	}
+
+	/* the content is dropped */
+	emit(e, token->buf, token->length);
+	if (label)
+		emit(e, ":", 1);
+}
+
+/* Writes the text of the tokens to @fd, with DOCUMENT_EMIT_DBGFILTER the
+ * .cfi_*, .loc and .debug* section lines commented out.  Returns -1 if the
+ * write fails */
+int document_emit(document_t *document, int fd, int flags)
+{
+	struct emitter e = { .fd = fd };
+	int newline = 1, dbgsection = 0;
+	token_t *token;
+
+	list_for_each_entry(token, &document->tokens, list) {
+		if (!(flags & DOCUMENT_EMIT_DBGFILTER)) {
+			emit_token(&e, document, token);
+			continue;
+		}
+
+		if (token->type == DIRECTIVE_SECTION ||
+		    token->type == DIRECTIVE_PUSHSECTION) {
+			/* FIXME(pboldin) account for POPSECTION */
+			dbgsection = !strncmp(
+				token_next(token)->txt,
+				".debug", 6);
+		}
+		if (newline &&
+		    token->type != DIRECTIVE_IDENT &&
+		    (token->type == DIRECTIVE_CFI_IGNORED ||
+		     token->type == DIRECTIVE_LOC_IGNORED ||
+		     dbgsection)) {
+			emit(&e, "# ", 2);
+		}
+		emit_token(&e, document, token);
+		newline = token->type == NEWLINE;
+	}
+	emit_flush(&e);
+
+	if (e.error) {
+		errno = e.error;
+		return -1;
+	}
+	return 0;
+}
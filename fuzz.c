@@ -0,0 +1,816 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "document.h"
+#include "diff.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Fuzzing target and differential harness.
+ *
+ * Every input is parsed with the default parser and with each of the
+ * alternative modes below, the resulting documents must be the same.  It
+ * is also gzipped in memory, as one and as two members, and read back; a
+ * truncated copy must fail to parse.
+ * Optionally parse time is checked to grow linearly: a big input is
+ * compared with its prefix, a small one with itself repeated many times.
+ * Also optionally the input is parsed past the first 4 GB of a document,
+ * the offsets and lines must then be the same, only shifted.
+ *
+ * Built with LIBFUZZER=1 this is a libFuzzer target, otherwise a driver
+ * taking files which is suitable for AFL (./fuzz @@) and for the tests.
+ */
+
+struct fuzz_mode {
+	const char *name;
+	struct parse_opts opts;
+	/* parse twice sharing the symbol bodies */
+	int dedup;
+};
+
+static const struct fuzz_mode fuzz_modes[] = {
+	{ "chunks", { .jobs = 4, .chunk_size = 1 } },
+	{ "chunks-2", { .jobs = 2, .chunk_size = 64 } },
+	{ "drop-tokens", { .drop = DOCUMENT_DROP_TOKENS } },
+	{ "drop-all", { .drop = DOCUMENT_DROP_TOKENS |
+			DOCUMENT_DROP_CONTENT } },
+	{ "lazy-symbols", { .lazy_symbols = 1 } },
+	{ "chunks-lazy", { .jobs = 4, .chunk_size = 1, .lazy_symbols = 1 } },
+	{ "in-place", { 0 } },
+	{ "pipeline", { .pipeline = 1 } },
+	{ "dedup", { .drop = DOCUMENT_DROP_TOKENS | DOCUMENT_DROP_CONTENT },
+	  .dedup = 1 },
+	{ "dedup-tokens", { 0 }, .dedup = 1 },
+	{ NULL }
+};
+
+/* Inputs smaller than that are repeated until they are that big, then grow
+ * that many times */
+#define SCALING_BASE		(64 << 10)
+#define SCALING_FACTOR		8
+/* allowed excess over the linear growth */
+#define SCALING_SLACK		3
+/* shorter parses are too noisy to judge */
+#define SCALING_MIN_NS		2000000
+#define SCALING_RUNS		3
+
+/* The huge document is sparse, the input is put that far in it, after a
+ * newline every HUGE_LINE_STRIDE bytes */
+#define HUGE_BASE		((size_t)9 << 29)
+#define HUGE_LINE_STRIDE	((size_t)1 << 30)
+
+/* The reference is parsed from a copy by a new scanner, the modes scan the
+ * content in place with the scanner of the harness */
+static
+document_t *fuzz_parse(const char *data, size_t size,
+		       const struct parse_opts *opts)
+{
+	static struct parse_ctx *ctx;
+	struct parse_opts mode_opts;
+	char *content;
+
+	/* the document takes the content over */
+	content = malloc(size + DOCUMENT_PADDING);
+	if (content == NULL)
+		abort();
+	memcpy(content, data, size);
+	memset(content + size, 0, DOCUMENT_PADDING);
+
+	if (opts == NULL)
+		return document_parse_content_opts(content, size, NULL);
+
+	if (ctx == NULL)
+		ctx = parse_ctx_new();
+	mode_opts = *opts;
+	mode_opts.padded = 1;
+	mode_opts.ctx = ctx;
+
+	return document_parse_content_opts(content, size, &mode_opts);
+}
+
+static
+int fuzz_report(const char *mode, const char *what)
+{
+	fprintf(stderr, "fuzz: mode = %s, mismatch = %s\n", mode, what);
+	return 1;
+}
+
+static
+int statements_equal(statement_t *a, statement_t *b)
+{
+	if (a == NULL || b == NULL)
+		return a == b;
+
+	/* statements of the documents compared are in the same order, so
+	 * is their content */
+	return a->id == b->id && a->length == b->length &&
+	       a->skipped == b->skipped &&
+	       !memcmp(a->text, b->text, a->length) &&
+	       !statement_compare(a, b);
+}
+
+static
+int symbols_equal(struct symbol *a, struct symbol *b)
+{
+	int aux;
+
+	if (strcmp(a->name, b->name) || a->type != b->type)
+		return 0;
+
+	if ((a->section == NULL) != (b->section == NULL) ||
+	    (a->section && strcmp(a->section->name, b->section->name)))
+		return 0;
+
+	if (a->aux_mask != b->aux_mask)
+		return 0;
+	for (aux = 0; aux < SYMBOL_AUX_MAX; aux++)
+		if (!statements_equal(symbol_get_aux(a, aux),
+				      symbol_get_aux(b, aux)))
+			return 0;
+
+	return !symbol_compare(a, b);
+}
+
+static
+int sections_equal(section_t *a, section_t *b)
+{
+	statement_t **sa, **sb;
+	unsigned int i;
+
+	if (strcmp(a->name, b->name) || a->type != b->type ||
+	    a->nranges != b->nranges ||
+	    a->statements.n != b->statements.n ||
+	    a->nstatements != b->nstatements || a->start != b->start ||
+	    a->end != b->end || a->bytes != b->bytes)
+		return 0;
+
+	sa = stmt_vec_items(&a->statements);
+	sb = stmt_vec_items(&b->statements);
+	for (i = 0; i < a->statements.n; i++)
+		if (!statements_equal(sa[i], sb[i]))
+			return 0;
+
+	for (i = 0; i < a->nranges; i++)
+		if (a->ranges[i].first->id != b->ranges[i].first->id ||
+		    a->ranges[i].n != b->ranges[i].n)
+			return 0;
+
+	return !section_compare(a, b);
+}
+
+/* Returns non-zero and reports the first difference found */
+static
+int documents_differ(const char *mode, document_t *a, document_t *b)
+{
+	list_t *la, *lb;
+	struct symbol *sa, *sb;
+	section_t *ca, *cb;
+	struct diagnostic *da, *db;
+	int i;
+
+	if (a == NULL || b == NULL)
+		return a != b ? fuzz_report(mode, "parse result") : 0;
+
+	if (a->ndiags != b->ndiags)
+		return fuzz_report(mode, "number of diagnostics");
+	for (i = 0; i < a->ndiags; i++) {
+		da = &a->diags[i];
+		db = &b->diags[i];
+		if (da->offset != db->offset ||
+		    da->line_offset != db->line_offset ||
+		    strcmp(da->msg, db->msg) ||
+		    !statements_equal(da->stmt, db->stmt))
+			return fuzz_report(mode, "diagnostic");
+	}
+
+	for (la = a->statements.next, lb = b->statements.next;
+	     la != &a->statements && lb != &b->statements;
+	     la = la->next, lb = lb->next) {
+		if (!statements_equal(list_entry(la, statement_t, list),
+				      list_entry(lb, statement_t, list)))
+			return fuzz_report(mode, "statement");
+	}
+	if (la != &a->statements || lb != &b->statements)
+		return fuzz_report(mode, "number of statements");
+
+	/* LRU order is what the symbols are printed in */
+	for (sa = document_symbols(a), sb = document_symbols(b); sa && sb;
+	     sa = sa->next, sb = sb->next) {
+		if (!symbols_equal(sa, sb))
+			return fuzz_report(mode, "symbol");
+	}
+	if (sa || sb)
+		return fuzz_report(mode, "number of symbols");
+
+	for (ca = a->sections, cb = b->sections; ca && cb;
+	     ca = ca->next, cb = cb->next) {
+		if (!sections_equal(ca, cb))
+			return fuzz_report(mode, "section");
+	}
+	if (ca || cb)
+		return fuzz_report(mode, "number of sections");
+
+	return 0;
+}
+
+/* @data with its local labels renumbered and a blank after each tab, the
+ * same bodies for dedup.c */
+static
+char *renumber(const char *data, size_t size, size_t *psize)
+{
+	const char *p, *end = data + size, *digits;
+	int quoted = 0;
+	size_t n = 0;
+	char *out;
+
+	/* a tab or a .L0 at most doubles */
+	out = malloc(2 * size + 16);
+	if (out == NULL)
+		abort();
+
+	for (p = data; p < end; p++) {
+		if (*p == '\n')
+			quoted = 0;
+		else if (*p == '"')
+			quoted = !quoted;
+		else if (*p == '\\' && quoted && p + 1 < end)
+			out[n++] = *p++;
+
+		out[n++] = *p;
+		if (quoted)
+			continue;
+		if (*p == '\t')
+			out[n++] = ' ';
+		if (*p != '.' || p + 1 == end || p[1] != 'L')
+			continue;
+
+		/* .L, letters, then the number grows by 1000 */
+		for (out[n++] = *++p, p++; p < end && ((*p >= 'a' && *p <= 'z') ||
+			       (*p >= 'A' && *p <= 'Z')); p++)
+			out[n++] = *p;
+		for (digits = p; p < end && *p >= '0' && *p <= '9' &&
+		     p - digits < 9; p++)
+			;
+		if (p > digits)
+			n += sprintf(out + n, "%ld",
+				     strtol(digits, NULL, 10) + 1000);
+		else
+			p = digits;
+		p--;
+	}
+
+	*psize = n;
+	return out;
+}
+
+/* Both parses must match the reference and have all their symbols
+ * shared, which takes less memory than the same parse not sharing these
+ * as soon as a symbol has statements.  The renumbered input shares these
+ * bodies too */
+static
+int fuzz_dedup(const struct fuzz_mode *mode, const char *data, size_t size,
+	       document_t *reference)
+{
+	struct parse_opts opts = mode->opts;
+	document_t *a, *b, *c, *plain;
+	struct symbol *sa, *sb, *sc;
+	int rv = 0, shared = 0;
+	size_t csize;
+	char *cdata;
+
+	opts.store = body_store_new();
+	a = fuzz_parse(data, size, &opts);
+	b = fuzz_parse(data, size, &opts);
+	plain = fuzz_parse(data, size, &mode->opts);
+	cdata = renumber(data, size, &csize);
+	c = fuzz_parse(cdata, csize, &opts);
+
+	rv |= documents_differ(mode->name, reference, a);
+	rv |= documents_differ(mode->name, reference, b);
+
+	if (a && c) {
+		document_for_each_symbol(sa, a) {
+			sc = document_find_symbol(c, sa->name);
+			if (sc && sc->statements.n &&
+			    (sa->body != sc->body || symbol_compare(sa, sc) ||
+			     (plain && symbol_compare(document_find_symbol(
+					plain, sa->name), sc)))) {
+				rv |= fuzz_report(mode->name,
+						  "renumbered body");
+				break;
+			}
+		}
+	}
+
+	if (a && b) {
+		for (sa = document_symbols(a), sb = document_symbols(b);
+		     sa && sb; sa = sa->next, sb = sb->next) {
+			if (sa->body != sb->body) {
+				rv |= fuzz_report(mode->name, "shared body");
+				break;
+			}
+			shared |= sb->statements.n != 0;
+		}
+	}
+
+	if (b && plain && (shared ? b->mem->used >= plain->mem->used :
+				    b->mem->used > plain->mem->used))
+		rv |= fuzz_report(mode->name, "memory used");
+
+	if (a)
+		document_free(a);
+	if (b)
+		document_free(b);
+	if (plain)
+		document_free(plain);
+	if (c)
+		document_free(c);
+	free(cdata);
+	body_store_free(opts.store);
+
+	return rv;
+}
+
+#ifdef HAVE_ZLIB
+/* Appends @data as one gzip member at @out, returns its size */
+static
+size_t gzip_member(const char *data, size_t size, unsigned char *out,
+		   size_t alloc)
+{
+	z_stream zs = { 0 };
+
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+			 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		abort();
+	zs.next_in = (Bytef *)data;
+	zs.avail_in = size;
+	zs.next_out = out;
+	zs.avail_out = alloc;
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+		abort();
+	deflateEnd(&zs);
+
+	return alloc - zs.avail_out;
+}
+
+static
+document_t *gzip_parse(const char *mode, const unsigned char *gz,
+		       size_t size, const struct parse_opts *opts)
+{
+	struct parse_opts named_opts = *opts;
+	document_t *document;
+	FILE *fh;
+
+	fh = fmemopen((void *)gz, size, "r");
+	if (fh == NULL)
+		abort();
+	named_opts.name = mode;
+	document = document_parse_FILE_opts(fh, &named_opts);
+	fclose(fh);
+
+	return document;
+}
+
+static
+int fuzz_gzip(const char *data, size_t size, document_t *reference)
+{
+	static const struct parse_opts sequential, chunks = {
+		.jobs = 4, .chunk_size = 1
+	}, quiet = { .quiet = 1 };
+	unsigned char *gz;
+	size_t alloc, n, half = size / 2;
+	document_t *document;
+	int rv = 0;
+
+	/* room for two members at the worst deflate expansion */
+	alloc = 2 * (size + 1024) + size / 100;
+	gz = malloc(alloc);
+	if (gz == NULL)
+		abort();
+
+	n = gzip_member(data, size, gz, alloc);
+
+	/* the size is known from the trailer, the content is streamed */
+	document = gzip_parse("gzip", gz, n, &sequential);
+	rv |= documents_differ("gzip", reference, document);
+	if (document)
+		document_free(document);
+
+	document = gzip_parse("gzip-chunks", gz, n, &chunks);
+	rv |= documents_differ("gzip-chunks", reference, document);
+	if (document)
+		document_free(document);
+
+	/* the trailer is gone, the parse must fail */
+	document = gzip_parse("gzip-truncated", gz, n - 1, &quiet);
+	if (document) {
+		rv |= fuzz_report("gzip-truncated", "parse result");
+		document_free(document);
+	}
+
+	n = gzip_member(data, half, gz, alloc);
+	n += gzip_member(data + half, size - half, gz + n, alloc - n);
+	document = gzip_parse("gzip-members", gz, n, &sequential);
+	rv |= documents_differ("gzip-members", reference, document);
+	if (document)
+		document_free(document);
+
+	free(gz);
+	return rv;
+}
+#endif
+
+static
+int fuzz_differential(const char *data, size_t size)
+{
+	const struct fuzz_mode *mode;
+	document_t *reference, *document;
+	int rv = 0;
+
+	reference = fuzz_parse(data, size, NULL);
+
+	for (mode = fuzz_modes; mode->name; mode++) {
+		if (mode->dedup) {
+			rv |= fuzz_dedup(mode, data, size, reference);
+			continue;
+		}
+		document = fuzz_parse(data, size, &mode->opts);
+		rv |= documents_differ(mode->name, reference, document);
+		if (document)
+			document_free(document);
+	}
+#ifdef HAVE_ZLIB
+	rv |= fuzz_gzip(data, size, reference);
+#endif
+
+	if (reference)
+		document_free(reference);
+
+	return rv;
+}
+
+static
+long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Best of a few parses of the input repeated @copies times */
+static
+long long parse_time(const char *data, size_t size, size_t copies)
+{
+	document_t *document;
+	long long start, best = -1, t;
+	size_t i, stride = size + 1;
+	char *content;
+	int run;
+
+	for (run = 0; run < SCALING_RUNS; run++) {
+		content = malloc(stride * copies);
+		if (content == NULL)
+			abort();
+		for (i = 0; i < copies; i++) {
+			memcpy(content + i * stride, data, size);
+			content[i * stride + size] = '\n';
+		}
+
+		start = now_ns();
+		document = document_parse_content(content, stride * copies);
+		t = now_ns() - start;
+
+		if (document)
+			document_free(document);
+		if (best < 0 || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+static
+int scaling_report(const char *name, long long t1, long long tn,
+		   double growth)
+{
+	if (tn < SCALING_MIN_NS || tn <= t1 * growth * SCALING_SLACK)
+		return 0;
+
+	fprintf(stderr, "fuzz: input = %s, superlinear = %lld ns, "
+		"%lld ns for %.1f times the input\n", name, t1, tn, growth);
+	return 1;
+}
+
+static
+int fuzz_scaling(const char *name, const char *data, size_t size)
+{
+	long long t1, tn;
+	size_t copies, prefix;
+	const char *eol;
+	double growth;
+
+	if (size == 0)
+		return 0;
+
+	if (size >= SCALING_BASE) {
+		/* big enough on its own, compare with a prefix of it */
+		eol = memchr(data + size / SCALING_FACTOR, '\n',
+			     size - size / SCALING_FACTOR);
+		if (eol == NULL)
+			return 0;
+		prefix = eol - data;
+		t1 = parse_time(data, prefix, 1);
+		tn = parse_time(data, size, 1);
+		growth = (double)size / (prefix + 1);
+	} else {
+		copies = (SCALING_BASE + size - 1) / size;
+		t1 = parse_time(data, size, copies);
+		tn = parse_time(data, size, copies * SCALING_FACTOR);
+		growth = SCALING_FACTOR;
+	}
+
+	return scaling_report(name, t1, tn, growth);
+}
+
+/* @item repeated after @prefix, with its number, up to @bytes */
+static
+char *scaling_generate(const char *prefix, const char *item, size_t bytes,
+		       size_t *psize)
+{
+	size_t alloc = bytes + 64, size, i;
+	char *data;
+
+	data = malloc(alloc);
+	if (data == NULL)
+		abort();
+
+	size = snprintf(data, alloc, "%s", prefix);
+	for (i = 0; size < bytes; i++)
+		size += snprintf(data + size, alloc - size, item, i);
+
+	*psize = size;
+	return data;
+}
+
+/* Shapes the inputs given might lack: a line of many words, one of many
+ * words looked up as directives and many distinct symbols */
+static
+int fuzz_scaling_generated(void)
+{
+	static const struct {
+		const char *name, *prefix, *item;
+	} inputs[] = {
+		{ "long-line", "\tfoo\t", "w%zu, " },
+		{ "dot-words", "\tfoo\t", ".w%zu, " },
+		{ "labels", "", "s%zu:\n" },
+	};
+	size_t i, size1, sizen;
+	char *data1, *datan;
+	long long t1, tn;
+	int failed = 0;
+
+	for (i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+		data1 = scaling_generate(inputs[i].prefix, inputs[i].item,
+					 SCALING_BASE, &size1);
+		datan = scaling_generate(inputs[i].prefix, inputs[i].item,
+					 SCALING_BASE * SCALING_FACTOR, &sizen);
+
+		t1 = parse_time(data1, size1, 1);
+		tn = parse_time(datan, sizen, 1);
+		failed |= scaling_report(inputs[i].name, t1, tn,
+					 (double)sizen / size1);
+
+		free(data1);
+		free(datan);
+	}
+
+	return failed;
+}
+
+/* Same checks as documents_differ() on what depends on the offsets */
+static
+int huge_differs(document_t *a, document_t *b, int base_lines)
+{
+	list_t *la, *lb;
+	token_t *ta, *tb;
+	statement_t *sa, *sb;
+	struct diagnostic *da, *db;
+	long line;
+	int i;
+
+	if (a->ndiags != b->ndiags)
+		return fuzz_report("huge", "number of diagnostics");
+	for (i = 0; i < a->ndiags; i++) {
+		da = &a->diags[i];
+		db = &b->diags[i];
+		if (da->offset + HUGE_BASE != db->offset ||
+		    da->line_offset + HUGE_BASE != db->line_offset ||
+		    strcmp(da->msg, db->msg))
+			return fuzz_report("huge", "diagnostic");
+	}
+
+	for (la = a->tokens.next, lb = b->tokens.next;
+	     la != &a->tokens && lb != &b->tokens;
+	     la = la->next, lb = lb->next) {
+		ta = list_entry(la, token_t, list);
+		tb = list_entry(lb, token_t, list);
+		if (ta->offset + HUGE_BASE != tb->offset ||
+		    ta->type != tb->type || strcmp(ta->buf, tb->buf))
+			return fuzz_report("huge", "token");
+		if (document_lineno(a, ta->offset + ta->length) + base_lines !=
+		    document_lineno(b, tb->offset + tb->length))
+			return fuzz_report("huge", "token line");
+	}
+	if (la != &a->tokens || lb != &b->tokens)
+		return fuzz_report("huge", "number of tokens");
+
+	for (la = a->statements.next, lb = b->statements.next;
+	     la != &a->statements && lb != &b->statements;
+	     la = la->next, lb = lb->next) {
+		sa = list_entry(la, statement_t, list);
+		sb = list_entry(lb, statement_t, list);
+		if (sa->offset + HUGE_BASE != sb->offset ||
+		    sa->length != sb->length ||
+		    memcmp(sa->text, sb->text, sa->length))
+			return fuzz_report("huge", "statement");
+	}
+	if (la != &a->statements || lb != &b->statements)
+		return fuzz_report("huge", "number of statements");
+
+	for (i = 2; (line = document_line_offset(a, i)) >= 0; i++)
+		if (line + (long)HUGE_BASE !=
+		    document_line_offset(b, i + base_lines))
+			return fuzz_report("huge", "line offset");
+
+	return 0;
+}
+
+/* Parses the input as the range of a huge document past its first 4 GB.
+ * Only the pages written are backed by memory */
+static
+int fuzz_huge(const char *data, size_t size)
+{
+	document_t *reference, *document;
+	size_t alloc = HUGE_BASE + size + DOCUMENT_PADDING, i;
+	int base_lines = 0, rv;
+	char *content;
+
+	content = mmap(NULL, alloc, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (content == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	for (i = HUGE_LINE_STRIDE; i <= HUGE_BASE; i += HUGE_LINE_STRIDE) {
+		content[i - 1] = '\n';
+		base_lines++;
+	}
+	if (content[HUGE_BASE - 1] != '\n') {
+		content[HUGE_BASE - 1] = '\n';
+		base_lines++;
+	}
+	memcpy(content + HUGE_BASE, data, size);
+
+	reference = fuzz_parse(data, size, NULL);
+
+	document = document_new();
+	document->content = content;
+	document->size = HUGE_BASE + size;
+	rv = document_parse_range(document, HUGE_BASE, size);
+
+	if ((reference == NULL) != (rv != 0))
+		rv = fuzz_report("huge", "parse result");
+	else
+		rv = reference ? huge_differs(reference, document,
+					      base_lines) : 0;
+
+	if (reference)
+		document_free(reference);
+	/* not the document's to free */
+	document->content = NULL;
+	document_free(document);
+	munmap(content, alloc);
+
+	return rv;
+}
+
+#ifdef FUZZ_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+	static int scaling = -1;
+
+	if (scaling < 0)
+		scaling = getenv("FUZZ_SCALING") != NULL;
+
+	if (fuzz_differential((const char *)data, size))
+		abort();
+	if (scaling && fuzz_scaling("-", (const char *)data, size))
+		abort();
+
+	return 0;
+}
+
+#else
+
+static
+char *read_file(const char *path, size_t *psize)
+{
+	FILE *fh;
+	char *data = NULL;
+	size_t size = 0, alloc = 0, read;
+
+	fh = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (fh == NULL)
+		return NULL;
+
+	do {
+		if (size == alloc) {
+			alloc = alloc ? alloc * 2 : 4096;
+			data = realloc(data, alloc);
+			if (data == NULL)
+				abort();
+		}
+		read = fread(data + size, 1, alloc - size, fh);
+		size += read;
+	} while (read);
+
+	if (fh != stdin)
+		fclose(fh);
+
+	*psize = size;
+	return data;
+}
+
+static
+void usage(const char *prog)
+{
+	printf("%s: differential and scaling checks of the parser\n", prog);
+	printf("USAGE %s [--scaling] [--huge] FILE...\n", prog);
+	printf("  --scaling        flag parse time growing superlinearly\n");
+	printf("  --huge           parse past the first 4 GB of a document\n");
+}
+
+int main(int argc, char **argv)
+{
+	int i, scaling = 0, huge = 0, failed = 0;
+	size_t size;
+	char *data;
+
+	while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+		if (!strcmp(argv[1], "--scaling")) {
+			scaling = 1;
+		} else if (!strcmp(argv[1], "--huge")) {
+			huge = 1;
+		} else {
+			usage(argv[0]);
+			return !!strcmp(argv[1], "--help");
+		}
+		argv ++;
+		argc --;
+	}
+
+	if (argc < 2) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (scaling && fuzz_scaling_generated())
+		failed = 1;
+
+	for (i = 1; i < argc; i++) {
+		data = read_file(argv[i], &size);
+		if (data == NULL) {
+			perror(argv[i]);
+			failed = 1;
+			continue;
+		}
+
+		if (fuzz_differential(data, size)) {
+			fprintf(stderr, "fuzz: input = %s, modes differ\n",
+				argv[i]);
+			failed = 1;
+		}
+		if (scaling && fuzz_scaling(argv[i], data, size))
+			failed = 1;
+		if (huge && fuzz_huge(data, size)) {
+			fprintf(stderr, "fuzz: input = %s, huge differs\n",
+				argv[i]);
+			failed = 1;
+		}
+
+		free(data);
+	}
+
+	return failed;
+}
+
+#endif
@@ -0,0 +1,87 @@
+# Generates a perfect hash for the directives listed in directives.list:
+#
+#	h = (a * len + b * s[0] + c * s[1] + d * s[len - 1]) % DIRECTIVE_HASH_SIZE
+#
+# the multipliers are searched for until there are no collisions.
+
+BEGIN {
+	for (i = 0; i < 256; i++)
+		ord[sprintf("%c", i)] = i;
+	size = 64;
+	n = 0;
+}
+
+/^#/ || NF == 0 {
+	next
+}
+
+{
+	name[n] = $1;
+	token[n] = $2;
+	rest[n] = $3 == "rest";
+	len[n] = length($1);
+	c0[n] = ord[substr($1, 1, 1)];
+	c1[n] = ord[substr($1, len[n] > 1 ? 2 : 1, 1)];
+	cl[n] = ord[substr($1, len[n], 1)];
+	if (len[n] > maxlen)
+		maxlen = len[n];
+	n++;
+}
+
+function try(a, b, c, d,	i, h, used) {
+	for (i = 0; i < n; i++) {
+		h = (a * len[i] + b * c0[i] + c * c1[i] + d * cl[i]) % size;
+		if (h in used)
+			return 0;
+		used[h] = 1;
+		slot[i] = h;
+	}
+	return 1;
+}
+
+function search(	b, c, d) {
+	for (A = 1; A < size; A++)
+		for (b = 0; b < 8; b++)
+			for (c = 0; c < 8; c++)
+				for (d = 0; d < 8; d++)
+					if (try(A, b, c, d)) {
+						B = b;
+						C = c;
+						D = d;
+						return 1;
+					}
+	return 0;
+}
+
+END {
+	while (!search())
+		size *= 2;
+
+	for (i = 0; i < n; i++)
+		entry[slot[i]] = i;
+
+	print "/* Generated from directives.list by gendirectives.awk, do not edit */";
+	print "";
+	print "#define DIRECTIVE_HASH_SIZE\t" size;
+	print "#define DIRECTIVE_MAXLEN\t" maxlen;
+	print "";
+	print "static inline";
+	print "unsigned int directive_hash(const unsigned char *s, unsigned int len)";
+	print "{";
+	printf "\treturn (%d * len + %d * s[0] + %d * s[len > 1] + %d * s[len - 1]) %%\n", A, B, C, D;
+	print "\t       DIRECTIVE_HASH_SIZE;";
+	print "}";
+	print "";
+	print "static const struct directive {";
+	print "\tconst char *name;";
+	print "\tunsigned char length, rest;";
+	print "\tshort token;";
+	print "} directive_table[DIRECTIVE_HASH_SIZE] = {";
+	for (h = 0; h < size; h++) {
+		if (!(h in entry))
+			continue;
+		i = entry[h];
+		printf "\t[%d] = { \"%s\", %d, %d, %s },\n", h, name[i], len[i], rest[i], token[i];
+	}
+	print "};";
+}
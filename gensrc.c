@@ -1,7 +1,14 @@
 
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 #include "document.h"
+#include "diff.h"
 #include "y.tab.h"
 #include "flex.h"
 
@@ -13,61 +20,524 @@ void usage(FILE *fh)
 		fh = stderr;
 	fprintf(fh, "%s: generate diff source from inputs\n", prog_name);
 	fprintf(fh, "USAGE %s [--debug] input1.s input2.s\n", prog_name);
+	fprintf(fh, "      %s [--debug] [OPTIONS] --batch MANIFEST\n", prog_name);
+	fprintf(fh, "      %s [--debug] [OPTIONS] --dirs ORIGDIR PATCHEDDIR\n", prog_name);
+	fprintf(fh, "OPTIONS:\n");
+	fprintf(fh, "  --jobs N         diff N pairs in parallel\n");
+	fprintf(fh, "  --parse-jobs N   parse each file on N threads\n");
+	fprintf(fh, "  --mem-budget B   keep documents being diffed within B bytes\n");
+	fprintf(fh, "  --output DIR     write per-pair results to DIR/NAME.diff\n");
+	fprintf(fh, "  --mem-stats      report peak memory usage\n");
+	fprintf(fh, "  --dedup          share identical symbol bodies of the inputs\n");
+	fprintf(fh, "  --read-ahead N   read up to N inputs ahead of the parsers\n");
 	exit(fh == stderr ? -1 : 0);
 }
 
+/* Batch mode */
+
+/* Rough size of the parsed document per byte of the input */
+#define DOCUMENT_MEM_FACTOR	16
+
+struct pair {
+	char *left, *right, *name;
+	size_t cost;
+
+	/* results */
+	char *out, *symbols;
+	size_t outlen, symbolslen;
+	int failed;
+	int changes[SYMBOL_REMOVED + 1];
+};
+
+/* A file of one of the --dirs trees without a counterpart in the other */
+struct missing {
+	char *name, *path;
+};
+
+struct batch {
+	struct pair *pairs;
+	int npairs, alloc;
+	int next;
+
+	/* reported sorted by name along with the summary */
+	struct missing *missing;
+	int nmissing, missing_alloc;
+
+	int jobs, mem_stats;
+	const char *output;
+	struct parse_opts opts;
+
+	/* left and right paths of the pairs in turn, read ahead */
+	char **paths;
+	struct readahead *ra;
+	int read_ahead;
+
+	/* Documents being diffed are accounted against the budget, workers
+	 * wait for others to free theirs when it is exhausted */
+	size_t budget, used, peak;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static
+void batch_add_pair(struct batch *batch, const char *left, const char *right,
+		    const char *name)
+{
+	struct pair *pair;
+	struct stat st;
+
+	if (batch->npairs == batch->alloc) {
+		batch->alloc = batch->alloc ? batch->alloc * 2 : 64;
+		batch->pairs = realloc(batch->pairs,
+				       sizeof(*batch->pairs) * batch->alloc);
+		if (batch->pairs == NULL)
+			abort();
+	}
+
+	pair = &batch->pairs[batch->npairs++];
+	memset(pair, 0, sizeof(*pair));
+
+	pair->left = strdup(left);
+	pair->right = strdup(right);
+	pair->name = strdup(name ? name : right);
+	if (!pair->left || !pair->right || !pair->name)
+		abort();
+
+	if (stat(left, &st) == 0)
+		pair->cost += st.st_size;
+	if (stat(right, &st) == 0)
+		pair->cost += st.st_size;
+	pair->cost *= DOCUMENT_MEM_FACTOR;
+}
+
+static
+int batch_read_manifest(struct batch *batch, const char *path)
+{
+	char *line = NULL, *left, *right, *name, *saveptr;
+	size_t n = 0;
+	FILE *fh;
+
+	fh = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	if (fh == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	while (getline(&line, &n, fh) > 0) {
+		left = strtok_r(line, " \t\n", &saveptr);
+		if (left == NULL || left[0] == '#')
+			continue;
+
+		right = strtok_r(NULL, " \t\n", &saveptr);
+		if (right == NULL) {
+			fprintf(stderr, "%s: no pair for %s\n", path, left);
+			continue;
+		}
+		name = strtok_r(NULL, " \t\n", &saveptr);
+
+		batch_add_pair(batch, left, right, name);
+	}
+
+	free(line);
+	if (fh != stdin)
+		fclose(fh);
+
+	return 0;
+}
+
+static
+void batch_add_missing(struct batch *batch, const char *name,
+		       const char *path)
+{
+	struct missing *missing;
+
+	if (batch->nmissing == batch->missing_alloc) {
+		batch->missing_alloc = batch->missing_alloc ?
+				       batch->missing_alloc * 2 : 16;
+		batch->missing = realloc(batch->missing,
+					 sizeof(*batch->missing) *
+					 batch->missing_alloc);
+		if (batch->missing == NULL)
+			abort();
+	}
+
+	missing = &batch->missing[batch->nmissing++];
+	missing->name = strdup(name);
+	missing->path = strdup(path);
+	if (!missing->name || !missing->path)
+		abort();
+}
+
+/* nftw() has no argument for the callback.  The right tree is walked
+ * second for the files only it has */
+static struct batch *walk_batch;
+static const char *walk_root, *walk_other;
+static int walk_right_tree;
+
+static
+int batch_walk_cb(const char *path, const struct stat *st, int flag,
+		  struct FTW *ftw)
+{
+	const char *rel = path + strlen(walk_root) + 1;
+	size_t len = strlen(path);
+	struct stat ost;
+	char *other;
+	int found;
+
+	if (flag != FTW_F || len < 2 || strcmp(path + len - 2, ".s"))
+		return 0;
+
+	if (asprintf(&other, "%s/%s", walk_other, rel) < 0)
+		abort();
+
+	found = stat(other, &ost) == 0 && S_ISREG(ost.st_mode);
+	if (!found)
+		batch_add_missing(walk_batch, rel, other);
+	else if (!walk_right_tree)
+		batch_add_pair(walk_batch, path, other, rel);
+
+	free(other);
+	return 0;
+}
+
+static
+int pair_name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct pair *)a)->name,
+		      ((const struct pair *)b)->name);
+}
+
 static
-int statement_compare(statement_t *stmt_a, statement_t *stmt_b)
+int missing_name_cmp(const void *a, const void *b)
 {
-	token_t *a, *b;
+	const struct missing *ma = a, *mb = b;
 	int rv;
 
-	a = statement_first_token(stmt_a);
-	b = statement_first_token(stmt_b);
+	rv = strcmp(ma->name, mb->name);
+	return rv ? rv : strcmp(ma->path, mb->path);
+}
 
-	do {
-		rv = strcmp(a->txt, b->txt);
-		if (rv)
-			return rv;
+static
+int batch_read_dirs(struct batch *batch, char *left, char *right)
+{
+	size_t len;
 
-		if (token_next(a) != sibling_next(a))
-			break;
+	for (len = strlen(left); len > 1 && left[len - 1] == '/'; len--)
+		left[len - 1] = '\0';
+	for (len = strlen(right); len > 1 && right[len - 1] == '/'; len--)
+		right[len - 1] = '\0';
 
-		if (token_next(b) != sibling_next(b))
-			break;
+	walk_batch = batch;
+	walk_root = left;
+	walk_other = right;
+	walk_right_tree = 0;
+	if (nftw(left, batch_walk_cb, 16, FTW_PHYS)) {
+		perror(left);
+		return -1;
+	}
 
-		a = sibling_next(a);
-		b = sibling_next(b);
-	} while (1);
+	walk_root = right;
+	walk_other = left;
+	walk_right_tree = 1;
+	if (nftw(right, batch_walk_cb, 16, FTW_PHYS)) {
+		perror(right);
+		return -1;
+	}
 
-	rv = (token_next(b) == sibling_next(b)) - (token_next(a) == sibling_next(a));
-	if (rv)
-		return rv;
+	/* directory order is up to the filesystem */
+	qsort(batch->pairs, batch->npairs, sizeof(*batch->pairs),
+	      pair_name_cmp);
+	qsort(batch->missing, batch->nmissing, sizeof(*batch->missing),
+	      missing_name_cmp);
 
 	return 0;
 }
 
-int main(int argc, char **argv) {
+/* Parsed documents are not kept around to be recycled: each pair is freed
+ * once diffed, the scanner is what the workers reuse.  The budget is kept by
+ * admitting pairs only while their estimated cost fits */
+static
+void batch_reserve(struct batch *batch, size_t cost)
+{
+	if (!batch->budget)
+		return;
+
+	pthread_mutex_lock(&batch->lock);
+	/* let an oversized pair through when nothing else is running */
+	while (batch->used && batch->used + cost > batch->budget)
+		pthread_cond_wait(&batch->cond, &batch->lock);
+	batch->used += cost;
+	pthread_mutex_unlock(&batch->lock);
+}
+
+/* Replaces the estimated cost with the actual one */
+static
+void batch_adjust(struct batch *batch, size_t *cost, size_t actual)
+{
+	pthread_mutex_lock(&batch->lock);
+	if (batch->budget) {
+		batch->used = batch->used - *cost + actual;
+		pthread_cond_broadcast(&batch->cond);
+	}
+	if (batch->used > batch->peak)
+		batch->peak = batch->used;
+	pthread_mutex_unlock(&batch->lock);
+
+	*cost = actual;
+}
+
+static
+void batch_release(struct batch *batch, size_t cost)
+{
+	if (!batch->budget)
+		return;
+
+	pthread_mutex_lock(&batch->lock);
+	batch->used -= cost;
+	pthread_cond_broadcast(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+}
+
+struct pair_ctx {
+	struct pair *pair;
+	FILE *out, *symbols;
+};
+
+static
+void pair_symbol_cb(void *arg, const char *name, int status)
+{
+	struct pair_ctx *ctx = arg;
+
+	fprintf(ctx->out, "symbol: name = %s, status = %s\n",
+		name, symbol_status2str(status));
+	fprintf(ctx->symbols, " %s", name);
+	ctx->pair->changes[status]++;
+}
+
+static
+int mkdir_p(char *path)
+{
+	char *p;
+
+	for (p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		if (mkdir(path, 0777) && errno != EEXIST) {
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+/* Whether @name has a ".." component, which would take the result out of
+ * the output directory */
+static
+int name_escapes(const char *name)
+{
+	const char *p;
+
+	for (p = name; p; p = strchr(p, '/')) {
+		while (*p == '/')
+			p++;
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || !p[2]))
+			return 1;
+	}
+
+	return 0;
+}
+
+static
+void batch_write_pair(struct batch *batch, struct pair *pair)
+{
+	const char *name = pair->name;
+	char *path;
+	FILE *fh;
+
+	if (name_escapes(name)) {
+		fprintf(stderr, "%s: name leaves the output directory\n",
+			name);
+		pair->failed = 1;
+		return;
+	}
+
+	while (*name == '/')
+		name++;
+
+	if (asprintf(&path, "%s/%s.diff", batch->output, name) < 0)
+		abort();
+
+	if (mkdir_p(path) || (fh = fopen(path, "w")) == NULL) {
+		perror(path);
+		free(path);
+		return;
+	}
+
+	fwrite(pair->out, 1, pair->outlen, fh);
+	fclose(fh);
+	free(path);
+}
+
+static
+void batch_diff_pair(struct batch *batch, struct pair *pair,
+		     struct parse_ctx *parse_ctx)
+{
+	document_t *left = NULL, *right = NULL;
+	struct parse_opts opts = batch->opts;
+	struct pair_ctx ctx;
+	size_t cost = pair->cost, i = pair - batch->pairs;
+
+	ctx.pair = pair;
+	ctx.out = open_memstream(&pair->out, &pair->outlen);
+	ctx.symbols = open_memstream(&pair->symbols, &pair->symbolslen);
+	if (ctx.out == NULL || ctx.symbols == NULL)
+		abort();
+
+	fprintf(ctx.out, "pair: left = %s, right = %s\n",
+		pair->left, pair->right);
+
+	batch_reserve(batch, cost);
+
+	opts.ctx = parse_ctx;
+	left = readahead_parse(batch->ra, 2 * i, &opts);
+	if (left)
+		right = readahead_parse(batch->ra, 2 * i + 1, &opts);
+
+	if (left && right) {
+		batch_adjust(batch, &cost,
+			     left->mem->used + right->mem->used);
+		document_print_diagnostics(left, ctx.out, pair->left);
+		document_print_diagnostics(right, ctx.out, pair->right);
+		document_diff_symbols(left, right, pair_symbol_cb, &ctx);
+	} else {
+		fprintf(ctx.out, "pair: failed to parse %s\n",
+			left ? pair->right : pair->left);
+		pair->failed = 1;
+	}
+
+	if (left)
+		document_free(left);
+	if (right)
+		document_free(right);
+
+	batch_release(batch, cost);
+
+	fclose(ctx.out);
+	fclose(ctx.symbols);
+
+	if (batch->output)
+		batch_write_pair(batch, pair);
+}
+
+static
+void *batch_worker(void *arg)
+{
+	struct batch *batch = arg;
+	struct parse_ctx *ctx;
 	int i;
-	document_t *left, *right;
-	statement_t *stmta, *stmtb, *stmtalast, *stmtblast;
 
-	prog_name = argv[0];
+	/* the scanner is reused for all of the pairs of the worker */
+	ctx = parse_ctx_new();
+	while ((i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED)) <
+	       batch->npairs)
+		batch_diff_pair(batch, &batch->pairs[i], ctx);
+	parse_ctx_free(ctx);
 
-	argv ++;
-	argc --;
+	return NULL;
+}
 
-	if (argc > 1 && !strcmp(argv[1], "--debug")) {
-		yydebug = 1;
-		argv ++;
-		argc --;
+static
+int batch_run(struct batch *batch)
+{
+	pthread_t *threads;
+	struct pair *pair;
+	int i, nthreads, failed = 0;
+	int total[SYMBOL_REMOVED + 1] = { 0 };
+
+	nthreads = batch->jobs > 1 ? batch->jobs : 1;
+	threads = malloc(sizeof(*threads) * nthreads);
+	batch->paths = malloc(sizeof(*batch->paths) * 2 * batch->npairs);
+	if (threads == NULL || batch->paths == NULL)
+		abort();
+
+	for (i = 0; i < batch->npairs; i++) {
+		batch->paths[2 * i] = batch->pairs[i].left;
+		batch->paths[2 * i + 1] = batch->pairs[i].right;
+	}
+	batch->ra = readahead_new(batch->paths, 2 * batch->npairs,
+				  batch->read_ahead);
+
+	/* the main thread is a worker too */
+	for (i = 1; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, batch_worker, batch))
+			break;
+	nthreads = i;
+	batch_worker(batch);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	readahead_free(batch->ra);
+	free(batch->paths);
+
+	for (pair = batch->pairs; pair < batch->pairs + batch->npairs; pair++) {
+		if (!batch->output)
+			fwrite(pair->out, 1, pair->outlen, stdout);
+
+		failed += pair->failed;
+		for (i = 0; i <= SYMBOL_REMOVED; i++)
+			total[i] += pair->changes[i];
+
+		if (pair->symbolslen)
+			printf("summary: name = %s, symbols =%s\n",
+			       pair->name, pair->symbols);
+
+		free(pair->out);
+		free(pair->symbols);
+		free(pair->left);
+		free(pair->right);
+		free(pair->name);
 	}
 
-	if (argc != 2)
-		usage(stderr);
+	for (i = 0; i < batch->nmissing; i++) {
+		printf("summary: name = %s, missing = %s\n",
+		       batch->missing[i].name, batch->missing[i].path);
+		free(batch->missing[i].name);
+		free(batch->missing[i].path);
+	}
+	free(batch->missing);
+
+	printf("summary: pairs = %d, failed = %d, changed = %d, new = %d, removed = %d\n",
+	       batch->npairs, failed, total[SYMBOL_CHANGED],
+	       total[SYMBOL_NEW], total[SYMBOL_REMOVED]);
+
+	if (batch->mem_stats)
+		fprintf(stderr, "memory: documents peak = %zu\n", batch->peak);
+
+	free(batch->pairs);
+
+	return failed ? 1 : 0;
+}
+
+/* Single pair mode */
+
+static
+int diff_two(const char *a, const char *b, struct parse_opts *opts)
+{
+	document_t *left, *right;
+	statement_t *stmta, *stmtb, *stmtalast, *stmtblast;
+
+	opts->ctx = parse_ctx_new();
+	left = document_parse_path_opts(a, opts);
+	right = document_parse_path_opts(b, opts);
+	parse_ctx_free(opts->ctx);
+	opts->ctx = NULL;
+	if (left == NULL || right == NULL)
+		return 1;
 
-	left = document_parse_path(argv[0]);
-	right = document_parse_path(argv[1]);
+	document_print_diagnostics(left, stderr, a);
+	document_print_diagnostics(right, stderr, b);
 
 	stmta = list_first_entry(&left->statements, statement_t, list);
 	stmtb = list_first_entry(&right->statements, statement_t, list);
@@ -87,3 +557,90 @@ int main(int argc, char **argv) {
 
 	return 0;
 }
+
+int main(int argc, char **argv) {
+	struct batch batch;
+	const char *manifest = NULL;
+	char *dirs = NULL;
+	int rv;
+
+	prog_name = argv[0];
+
+	argv ++;
+	argc --;
+
+	memset(&batch, 0, sizeof(batch));
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.cond, NULL);
+
+	while (argc > 0 && !strncmp(argv[0], "--", 2)) {
+		if (!strcmp(argv[0], "--debug")) {
+			yydebug = 1;
+		} else if (!strcmp(argv[0], "--mem-stats")) {
+			batch.mem_stats = 1;
+		} else if (!strcmp(argv[0], "--dedup")) {
+			batch.opts.store = body_store_new();
+		} else if (!strcmp(argv[0], "--help")) {
+			usage(stdout);
+		} else if (argc < 2) {
+			usage(stderr);
+		} else if (!strcmp(argv[0], "--jobs")) {
+			batch.jobs = atoi(argv[1]);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[0], "--read-ahead")) {
+			batch.read_ahead = atoi(argv[1]);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[0], "--parse-jobs")) {
+			batch.opts.jobs = atoi(argv[1]);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[0], "--mem-budget")) {
+			batch.budget = strtoull(argv[1], NULL, 0);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[0], "--output")) {
+			batch.output = argv[1];
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[0], "--batch")) {
+			manifest = argv[1];
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[0], "--dirs")) {
+			dirs = argv[1];
+			argv ++;
+			argc --;
+		} else {
+			usage(stderr);
+		}
+		argv ++;
+		argc --;
+	}
+
+	/* diffs only look at tokens */
+	batch.opts.drop = DOCUMENT_DROP_CONTENT;
+
+	if (manifest) {
+		if (argc != 0 || batch_read_manifest(&batch, manifest))
+			usage(stderr);
+		rv = batch_run(&batch);
+	} else if (dirs) {
+		if (argc != 1 || batch_read_dirs(&batch, dirs, argv[0]))
+			usage(stderr);
+		rv = batch_run(&batch);
+	} else {
+		if (argc != 2)
+			usage(stderr);
+		rv = diff_two(argv[0], argv[1], &batch.opts);
+	}
+
+	if (batch.mem_stats)
+		fprintf(stderr, "memory: peak rss = %ld KiB\n", mem_peak_rss());
+
+	if (batch.opts.store)
+		body_store_free(batch.opts.store);
+
+	return rv;
+}
@@ -0,0 +1,413 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "layout.h"
+
+/*
+ * Section layout.
+ *
+ * The statements of each section are walked in the order the assembler
+ * emits them, adding up what the alignment and data directives take, so
+ * that the offsets of the symbols and the sizes their .size directives
+ * evaluate to (.-table) are known without assembling the file.
+ *
+ * Instructions are left to the assembler: past the first one, or past any
+ * other statement of unknown size, the rest of the section is unresolved
+ * and the section records that statement.  Only the data directives and
+ * the directives known to take no room are sized, see data.c, so .fill or
+ * .dc.l leave the rest unresolved rather than misplaced.  Data sections
+ * are normally resolved whole, code sections up to their first
+ * instruction.
+ *
+ * .align is taken in bytes as on x86: on arm and aarch64 its operand is
+ * the power of two as for .p2align, the layout of these targets is only
+ * right for .balign and .p2align.
+ */
+
+/* Longest symbol name looked up in an expression */
+#define LAYOUT_NAME_MAX		256
+
+static inline
+int is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static inline
+int is_name_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	       (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '$';
+}
+
+/* Operand @i of a directive, comma separated, without the blanks.  Returns
+ * -1 if there are fewer */
+static
+int layout_operand(const char *p, const char *end, int i,
+		   const char **pstart, const char **pend)
+{
+	const char *q;
+
+	for (; i; i--) {
+		p = memchr(p, ',', end - p);
+		if (p == NULL)
+			return -1;
+		p++;
+	}
+
+	while (p < end && is_blank(*p))
+		p++;
+	q = memchr(p, ',', end - p);
+	if (q == NULL)
+		q = end;
+	while (q > p && is_blank(q[-1]))
+		q--;
+
+	*pstart = p;
+	*pend = q;
+	return 0;
+}
+
+static
+int layout_number(const char *p, const char *end, unsigned long long *pvalue)
+{
+	char buf[32], *tail;
+
+	if (p == end || end - p >= (long)sizeof(buf))
+		return -1;
+	memcpy(buf, p, end - p);
+	buf[end - p] = '\0';
+
+	*pvalue = strtoull(buf, &tail, 0);
+	return *tail ? -1 : 0;
+}
+
+/* .align, .balign and .p2align ALIGN[, FILL[, MAX]], .align is in bytes
+ * as on x86 */
+static
+int layout_align(struct layout_section *ls, const char *name, size_t length,
+		 const char *p, const char *end)
+{
+	unsigned long long align, max = 0;
+	const char *start, *stop;
+	size_t pad;
+
+	if (layout_operand(p, end, 0, &start, &stop) ||
+	    layout_number(start, stop, &align))
+		return -1;
+	if (length == 7 && !memcmp(name, "p2align", 7)) {
+		if (align >= 64)
+			return -1;
+		align = 1ULL << align;
+	}
+	if (align == 0)
+		align = 1;
+	if (align & (align - 1))
+		return -1;
+
+	if (layout_operand(p, end, 2, &start, &stop) == 0 &&
+	    start != stop && layout_number(start, stop, &max))
+		return -1;
+
+	/* the section is aligned even if the padding is skipped */
+	if (align > ls->align)
+		ls->align = align;
+
+	pad = -ls->size & (align - 1);
+	if (max == 0 || pad <= max)
+		ls->size += pad;
+	return 0;
+}
+
+/* Adds the bytes @stmt takes to the section, returns -1 if these are not
+ * known */
+static
+int layout_statement(struct layout_section *ls, statement_t *stmt,
+		     int is_label, struct data_image *scratch)
+{
+	const char *p, *end, *name;
+	size_t length, size;
+
+	if (is_label)
+		return 0;
+	if (stmt->text == NULL)
+		return -1;
+
+	p = stmt->text;
+	end = stmt->text + stmt->length;
+	while (p < end && is_blank(*p))
+		p++;
+	if (p == end || (*p >= '0' && *p <= '9'))
+		/* numeric label */
+		return 0;
+	if (*p != '.')
+		/* instruction */
+		return -1;
+
+	name = ++p;
+	while (p < end && !is_blank(*p))
+		p++;
+	length = p - name;
+
+	if ((length == 5 && !memcmp(name, "align", 5)) ||
+	    (length == 6 && !memcmp(name, "balign", 6)) ||
+	    (length == 7 && !memcmp(name, "p2align", 7)))
+		return layout_align(ls, name, length, p, end);
+
+	/* symbol and section directives, .cfi_* and local labels take no
+	 * room, directives not known there are unresolved */
+	if (statement_data_size(stmt, scratch, &size))
+		return -1;
+	ls->size += size;
+	return 0;
+}
+
+static
+void layout_section(struct layout *layout, struct layout_section *ls,
+		    const unsigned char *labels, struct data_image *scratch)
+{
+	struct stmt_range *range;
+	statement_t *stmt;
+	unsigned int k;
+
+	section_for_each_range(range, ls->section)
+		stmt_range_for_each(stmt, k, range) {
+			layout->stmt_sections[stmt->id] = ls - layout->sections;
+			if (ls->unresolved)
+				continue;
+			layout->offsets[stmt->id] = ls->size;
+			if (layout_statement(ls, stmt, labels[stmt->id],
+					     scratch))
+				ls->unresolved = stmt;
+		}
+}
+
+/* Offset and section of the symbol named [@p, @end), -1 if not known */
+static
+int layout_symbol_offset(struct layout *layout, const char *p,
+			 const char *end, size_t *poffset, int *psection)
+{
+	char name[LAYOUT_NAME_MAX];
+	statement_t *label;
+	struct symbol *s;
+
+	if (end - p >= LAYOUT_NAME_MAX)
+		return -1;
+	memcpy(name, p, end - p);
+	name[end - p] = '\0';
+
+	s = document_find_symbol(layout->document, name);
+	if (s == NULL)
+		return -1;
+	label = symbol_aux(s, label);
+	if (label == NULL || layout->offsets[label->id] == LAYOUT_UNKNOWN)
+		return -1;
+
+	*poffset = layout->offsets[label->id];
+	*psection = layout->stmt_sections[label->id];
+	return 0;
+}
+
+/* Evaluates a sum of numbers, symbols and '.' of the statement @stmt.  The
+ * symbols must be in its section and cancel out, as in .-table */
+static
+int layout_eval(struct layout *layout, statement_t *stmt, const char *p,
+		const char *end, size_t *pvalue)
+{
+	unsigned long long value = 0, term;
+	int sign = 1, relative = 0, section;
+	const char *start;
+	size_t offset;
+
+	if (layout->offsets[stmt->id] == LAYOUT_UNKNOWN)
+		return -1;
+
+	for (;;) {
+		while (p < end && is_blank(*p))
+			p++;
+		for (start = p; p < end && is_name_char(*p); p++)
+			;
+		if (start == p)
+			return -1;
+
+		if (p - start == 1 && *start == '.') {
+			term = layout->offsets[stmt->id];
+			relative += sign;
+		} else if (*start >= '0' && *start <= '9') {
+			if (layout_number(start, p, &term))
+				return -1;
+		} else {
+			if (layout_symbol_offset(layout, start, p, &offset,
+						 &section) ||
+			    section != layout->stmt_sections[stmt->id])
+				return -1;
+			term = offset;
+			relative += sign;
+		}
+		value += sign * term;
+
+		while (p < end && is_blank(*p))
+			p++;
+		if (p == end)
+			break;
+		if (*p != '+' && *p != '-')
+			return -1;
+		sign = *p++ == '+' ? 1 : -1;
+	}
+
+	if (relative)
+		return -1;
+	*pvalue = value;
+	return 0;
+}
+
+/* .size NAME, EXPR */
+static
+size_t layout_size(struct layout *layout, statement_t *stmt)
+{
+	const char *p, *end;
+	size_t size;
+
+	if (stmt->text == NULL)
+		return LAYOUT_UNKNOWN;
+	end = stmt->text + stmt->length;
+	p = memchr(stmt->text, ',', stmt->length);
+	if (p == NULL || layout_eval(layout, stmt, p + 1, end, &size))
+		return LAYOUT_UNKNOWN;
+
+	return size;
+}
+
+static
+void layout_add_symbols(struct layout *layout)
+{
+	struct layout_symbol *ls;
+	statement_t *label, *size;
+	struct symbol *s;
+	int n = 0, k;
+
+	document_for_each_symbol_sorted(s, layout->document)
+		n++;
+	layout->symbols = calloc(n ? n : 1, sizeof(*layout->symbols));
+	if (layout->symbols == NULL)
+		abort();
+
+	document_for_each_symbol_sorted(s, layout->document) {
+		label = symbol_aux(s, label);
+		if (label == NULL)
+			continue;
+		k = layout->stmt_sections[label->id];
+		if (k < 0)
+			continue;
+
+		ls = &layout->symbols[layout->nsymbols++];
+		ls->symbol = s;
+		ls->section = &layout->sections[k];
+		ls->offset = layout->offsets[label->id];
+		size = symbol_aux(s, size);
+		ls->size = size ? layout_size(layout, size) : LAYOUT_UNKNOWN;
+	}
+}
+
+struct layout *layout_build(document_t *document)
+{
+	struct data_image scratch = { 0 };
+	struct layout *layout;
+	unsigned char *labels;
+	section_t *section;
+	statement_t *label;
+	struct symbol *s;
+	size_t i, n;
+	int k = 0;
+
+	layout = calloc(1, sizeof(*layout));
+	if (layout == NULL)
+		abort();
+	layout->document = document;
+	document_keep_text(document);
+
+	n = document->nstatements ? document->nstatements : 1;
+	layout->offsets = malloc(sizeof(*layout->offsets) * n);
+	layout->stmt_sections = malloc(sizeof(*layout->stmt_sections) * n);
+	labels = calloc(n, sizeof(*labels));
+	if (layout->offsets == NULL || layout->stmt_sections == NULL ||
+	    labels == NULL)
+		abort();
+	for (i = 0; i < n; i++) {
+		layout->offsets[i] = LAYOUT_UNKNOWN;
+		layout->stmt_sections[i] = -1;
+	}
+
+	/* a label and an instruction without operands look the same once
+	 * the tokens are dropped */
+	document_for_each_symbol(s, document) {
+		label = symbol_aux(s, label);
+		if (label)
+			labels[label->id] = 1;
+	}
+
+	for (section = document->sections; section; section = section->next)
+		layout->nsections++;
+	layout->sections = calloc(layout->nsections ? layout->nsections : 1,
+				  sizeof(*layout->sections));
+	if (layout->sections == NULL)
+		abort();
+
+	for (section = document->sections; section; section = section->next) {
+		layout->sections[k].section = section;
+		layout->sections[k].align = 1;
+		layout_section(layout, &layout->sections[k], labels, &scratch);
+		k++;
+	}
+
+	layout_add_symbols(layout);
+
+	data_image_free(&scratch);
+	free(labels);
+	return layout;
+}
+
+void layout_free(struct layout *layout)
+{
+	free(layout->symbols);
+	free(layout->sections);
+	free(layout->stmt_sections);
+	free(layout->offsets);
+	free(layout);
+}
+
+static
+void layout_print_value(FILE *fh, const char *name, size_t value)
+{
+	if (value == LAYOUT_UNKNOWN)
+		fprintf(fh, ", %s = ?", name);
+	else
+		fprintf(fh, ", %s = %zu", name, value);
+}
+
+void layout_print(struct layout *layout, FILE *fh)
+{
+	struct layout_section *ls;
+	struct layout_symbol *sym;
+	int i;
+
+	for (i = 0; i < layout->nsections; i++) {
+		ls = &layout->sections[i];
+		fprintf(fh, "layout: section = %s, size = %zu, align = %zu%s\n",
+			ls->section->name, ls->size, ls->align,
+			ls->unresolved ? ", unresolved" : "");
+		statement_print(layout->document, fh, ls->unresolved,
+				"layout: unresolved = ");
+	}
+
+	for (i = 0; i < layout->nsymbols; i++) {
+		sym = &layout->symbols[i];
+		fprintf(fh, "layout: symbol = %s, section = %s",
+			sym->symbol->name, sym->section->section->name);
+		layout_print_value(fh, "offset", sym->offset);
+		layout_print_value(fh, "size", sym->size);
+		fprintf(fh, "\n");
+	}
+}
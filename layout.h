@@ -0,0 +1,48 @@
+#ifndef LAYOUT_H_INCLUDED
+#define LAYOUT_H_INCLUDED
+
+#include "document.h"
+
+/* Offset of the statements past an unresolved one */
+#define LAYOUT_UNKNOWN		((size_t)-1)
+
+struct layout_section {
+	section_t *section;
+	/* bytes up to the first unresolved statement and the alignment */
+	size_t size, align;
+	/* the statement of unknown size, an instruction mostly, or NULL */
+	statement_t *unresolved;
+};
+
+struct layout_symbol {
+	struct symbol *symbol;
+	struct layout_section *section;
+	/* LAYOUT_UNKNOWN if not resolved */
+	size_t offset, size;
+};
+
+/* Section layout: where the symbols are in their sections and the sizes
+ * their .size directives evaluate to, as the assembler would lay these out */
+struct layout {
+	document_t *document;
+
+	struct layout_section *sections;
+	int nsections;
+
+	struct layout_symbol *symbols;
+	int nsymbols;
+
+	/* offsets[i] of the statement id i in its section, LAYOUT_UNKNOWN
+	 * if not resolved or in no section */
+	size_t *offsets;
+	/* stmt_sections[i] is the index in sections of the statement id i,
+	 * -1 if in none */
+	int *stmt_sections;
+};
+
+struct layout *layout_build(document_t *document);
+void layout_free(struct layout *layout);
+
+void layout_print(struct layout *layout, FILE *fh);
+
+#endif /* LAYOUT_H_INCLUDED */
@@ -1,26 +1,212 @@
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "document.h"
+#include "layout.h"
+#include "posindex.h"
+#include "xref.h"
 #include "y.tab.h"
 #include "flex.h"
 
 int main(int argc, char **argv) {
-	int i;
+	struct parse_opts opts = { 0 };
+	int i, xref = 0, mem_stats = 0, symbols_only = 0, sorted = 0, rv = 0;
+	int read_ahead = 0, data = 0, layout = 0, round_trip = 0;
+	struct readahead *ra;
+	const char *prefix = NULL, *section_name = NULL, *closure = NULL;
+	char **positions;
+	int npositions = 0;
 
-	if (argc > 1 && !strcmp(argv[1], "--debug")) {
-		yydebug = 1;
+	positions = malloc(sizeof(*positions) * argc);
+	if (positions == NULL)
+		abort();
+
+	while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+		if (!strcmp(argv[1], "--debug")) {
+			yydebug = 1;
+		} else if (!strcmp(argv[1], "--xref")) {
+			xref = 1;
+		} else if (!strcmp(argv[1], "--xref-closure") && argc > 2) {
+			/* symbols reachable from and reaching SYM */
+			closure = argv[2];
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--jobs") && argc > 2) {
+			opts.jobs = atoi(argv[2]);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--chunk-size") && argc > 2) {
+			opts.chunk_size = strtoul(argv[2], NULL, 0);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--mem-budget") && argc > 2) {
+			opts.mem_budget = strtoull(argv[2], NULL, 0);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--sorted-symbols")) {
+			sorted = 1;
+		} else if (!strcmp(argv[1], "--symbol-prefix") && argc > 2) {
+			prefix = argv[2];
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--section") && argc > 2) {
+			section_name = argv[2];
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--position") && argc > 2) {
+			/* OFFSET or lLINE, the option can be repeated */
+			positions[npositions++] = argv[2];
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--round-trip")) {
+			round_trip = 1;
+		} else if (!strcmp(argv[1], "--layout")) {
+			layout = 1;
+		} else if (!strcmp(argv[1], "--data")) {
+			data = 1;
+		} else if (!strcmp(argv[1], "--lazy-symbols")) {
+			opts.lazy_symbols = 1;
+		} else if (!strcmp(argv[1], "--read-ahead") && argc > 2) {
+			read_ahead = atoi(argv[2]);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[1], "--pipeline")) {
+			opts.pipeline = 1;
+		} else if (!strcmp(argv[1], "--mem-stats")) {
+			mem_stats = 1;
+		} else if (!strcmp(argv[1], "--symbols-only")) {
+			/* statements keep their text, tokens are not needed */
+			symbols_only = 1;
+			opts.drop = DOCUMENT_DROP_TOKENS | DOCUMENT_DROP_CONTENT;
+		} else {
+			fprintf(stderr, "unknown option %s\n", argv[1]);
+			return 1;
+		}
 		argv ++;
 		argc --;
 	}
 
+	if (symbols_only && (xref || closure)) {
+		/* the references are found in the tokens */
+		fprintf(stderr, "--xref needs the tokens dropped by --symbols-only\n");
+		free(positions);
+		return 1;
+	}
+
+	/* one scanner for all of the files */
+	opts.ctx = parse_ctx_new();
+	ra = readahead_new(argv + 1, argc - 1, read_ahead);
+
 	for (i = 1; i < argc; i++) {
 		document_t *document;
 
-		document = document_parse_path(argv[i]);
+		document = readahead_parse(ra, i - 1, &opts);
 		if (document) {
-			document_print(document);
+			document_print_diagnostics(document, stderr, argv[i]);
+			if (mem_stats)
+				fprintf(stderr, "memory: path = %s, used = %zu, peak = %zu\n",
+					argv[i], document->mem->used,
+					document->mem->peak);
+			if (npositions) {
+				struct posindex *index;
+				struct position pos;
+				int k;
+
+				index = posindex_build(document);
+				for (k = 0; k < npositions; k++) {
+					if (posindex_lookup_spec(index,
+								 positions[k],
+								 &pos))
+						fprintf(stderr, "%s: nothing at %s\n",
+							argv[i], positions[k]);
+					else
+						position_print(index, stdout, &pos);
+				}
+				posindex_free(index);
+			} else if (round_trip) {
+				fflush(stdout);
+				if (document_emit(document, fileno(stdout), 0))
+					perror(argv[i]);
+			} else if (layout) {
+				struct layout *l = layout_build(document);
+
+				layout_print(l, stdout);
+				layout_free(l);
+			} else if (data) {
+				struct data_image image = { 0 };
+				struct symbol *s;
+
+				document_for_each_symbol(s, document) {
+					if (symbol_decode_data(s, &image)) {
+						fprintf(stderr, "%s: can not decode %s\n",
+							argv[i], s->name);
+						continue;
+					}
+					if (image.size || image.nrelocs)
+						data_image_print(s, &image);
+				}
+				data_image_free(&image);
+			} else if (section_name) {
+				struct stmt_range *range;
+				section_t *section;
+				statement_t *stmt;
+				unsigned int k;
+
+				section = document_find_section(document,
+								section_name);
+				if (section == NULL) {
+					fprintf(stderr, "%s: no section %s\n",
+						argv[i], section_name);
+				} else {
+					section_print_summary(stdout, section);
+					section_for_each_range(range, section)
+						stmt_range_for_each(stmt, k,
+								    range)
+							statement_print(document,
+									stdout, stmt,
+									"");
+				}
+			} else if (prefix) {
+				struct symbol *s;
+
+				document_for_each_symbol_prefix(s, document,
+								prefix)
+					symbol_print(document, stdout, s);
+			} else if (symbols_only && sorted) {
+				document_print_symbols_sorted(document);
+			} else if (symbols_only) {
+				document_print_symbols(document);
+			} else if (sorted) {
+				document_print_statements(document);
+				document_print_symbols_sorted(document);
+				document_print_dbgfilter(document);
+			} else {
+				document_print(document);
+			}
+			if (xref || closure) {
+				struct xref *x = xref_build(document);
+
+				if (xref)
+					xref_print(x);
+				if (closure && xref_print_closure(x, closure))
+					fprintf(stderr, "%s: no symbol %s\n",
+						argv[i], closure);
+				xref_free(x);
+			}
 			document_free(document);
+		} else {
+			fprintf(stderr, "%s: failed to parse\n", argv[i]);
+			rv = 1;
 		}
 	}
+
+	readahead_free(ra);
+	parse_ctx_free(opts.ctx);
+	free(positions);
+
+	if (mem_stats)
+		fprintf(stderr, "memory: peak rss = %ld KiB\n", mem_peak_rss());
+
+	return rv;
 }
@@ -0,0 +1,824 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "document.h"
+#include "diff.h"
+#include "layout.h"
+#include "posindex.h"
+
+/*
+ * Parser daemon.
+ *
+ * Listens on a Unix socket for line-based requests and keeps the parsed
+ * documents in an LRU cache keyed by path, modification time and content
+ * hash, so that repeated requests for the same files skip reading and
+ * parsing them.  Each response ends with a line "ok" or "error: REASON".
+ *
+ *   parse PATH			diagnostics and the document summary
+ *   diff LEFT RIGHT		symbols changed, new in RIGHT or removed
+ *   symbol PATH NAME		the symbol as printed by parser
+ *   section PATH NAME		the section summary and statements
+ *   position PATH OFFSET	what is at OFFSET, or at the line of lLINE
+ *   layout PATH		section sizes, symbol offsets and sizes
+ *   stats			cache and shared body statistics
+ *
+ * Each client is served on a thread of its own with its own scanner and
+ * response stream, so the requests of different clients run concurrently.
+ * The cache lock is only held around lookups and updates of the entries;
+ * an entry is referenced by each request using it, so evicting it does not
+ * free the document under a request.  The requests read the documents
+ * under the read lock of the entry; the lazy symbols, the position index
+ * and the texts pinned by the layout are built once under its write lock.
+ * The socket is only accessible to the user running the daemon.
+ */
+
+/* what a request needs built in the document */
+#define ENTRY_SYMBOLS		1
+#define ENTRY_INDEX		2
+#define ENTRY_TEXT		4
+
+#define CACHE_ENTRIES_DEFAULT	64
+/* a client not reading its response is dropped after that long */
+#define SEND_TIMEOUT_SEC	10
+
+struct cache_entry {
+	char *path;
+	struct timespec mtime;
+	off_t size;
+	unsigned long long hash;
+	document_t *document;
+	/* built on the first position request */
+	struct posindex *index;
+	/* ENTRY_ what is built, under the write lock */
+	int built;
+	pthread_rwlock_t lock;
+	/* the cache while linked and each request using it */
+	int refs;
+
+	struct cache_entry *next;
+};
+
+struct cache {
+	/* most recently used first */
+	struct cache_entry *entries;
+	int nentries, max;
+	unsigned long hits, misses;
+	struct parse_opts opts;
+
+	/* held around lookups and updates of the entries and counters */
+	pthread_mutex_t lock;
+};
+
+/* the entries used by a request at most */
+#define REQUEST_ENTRIES		2
+
+struct client {
+	struct cache *cache;
+	int fd;
+	FILE *out;
+	/* the options of the cache with the scanner of the client */
+	struct parse_opts opts;
+
+	/* released once the request is handled, read locked once it reads
+	 * the documents */
+	struct cache_entry *entries[REQUEST_ENTRIES];
+	int nentries, locked;
+};
+
+static const char *prog_name;
+
+static
+void usage(FILE *fh)
+{
+	fprintf(fh, "%s: serve parse, diff and query requests\n", prog_name);
+	fprintf(fh, "USAGE %s [OPTIONS] SOCKET\n", prog_name);
+	fprintf(fh, "OPTIONS:\n");
+	fprintf(fh, "  --cache N        keep N >= 2 parsed documents (default %d)\n",
+		CACHE_ENTRIES_DEFAULT);
+	fprintf(fh, "  --parse-jobs N   parse each file on N threads\n");
+	fprintf(fh, "  --dedup          share identical symbol bodies of the documents\n");
+	exit(fh == stderr ? -1 : 0);
+}
+
+/* FNV-1a */
+static
+unsigned long long content_hash(const char *p, size_t size)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	while (size--) {
+		hash ^= (unsigned char)*p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static
+char *read_content(int fd, size_t size)
+{
+	char *content;
+	size_t done = 0;
+	ssize_t rv;
+
+	content = malloc(size + DOCUMENT_PADDING);
+	if (content == NULL)
+		abort();
+	memset(content + size, 0, DOCUMENT_PADDING);
+
+	while (done < size) {
+		rv = read(fd, content + done, size - done);
+		if (rv < 0 && errno == EINTR)
+			continue;
+		if (rv <= 0) {
+			free(content);
+			return NULL;
+		}
+		done += rv;
+	}
+
+	return content;
+}
+
+static
+void cache_entry_free(struct cache_entry *entry)
+{
+	if (entry->index)
+		posindex_free(entry->index);
+	if (entry->document)
+		document_free(entry->document);
+	pthread_rwlock_destroy(&entry->lock);
+	free(entry->path);
+	free(entry);
+}
+
+/* Drops a reference with the cache lock held.  Returns the entry once it
+ * is unused, to be freed after the lock is released */
+static
+struct cache_entry *cache_entry_unref(struct cache_entry *entry)
+{
+	return --entry->refs ? NULL : entry;
+}
+
+static
+void cache_release(struct cache *cache, struct cache_entry *entry)
+{
+	pthread_mutex_lock(&cache->lock);
+	entry = cache_entry_unref(entry);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (entry)
+		cache_entry_free(entry);
+}
+
+/* Unlinks @entry, returns 0 if it is no longer in the cache */
+static
+int cache_unlink(struct cache *cache, struct cache_entry *entry)
+{
+	struct cache_entry **p;
+
+	for (p = &cache->entries; *p; p = &(*p)->next) {
+		if (*p == entry) {
+			*p = entry->next;
+			cache->nentries--;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static
+void cache_link(struct cache *cache, struct cache_entry *entry)
+{
+	entry->next = cache->entries;
+	cache->entries = entry;
+	cache->nentries++;
+}
+
+static
+struct cache_entry *cache_find(struct cache *cache, const char *path)
+{
+	struct cache_entry *entry;
+
+	for (entry = cache->entries; entry; entry = entry->next)
+		if (!strcmp(entry->path, path))
+			return entry;
+
+	return NULL;
+}
+
+/* Makes @entry the most recently used one unless it was evicted */
+static
+void cache_touch(struct cache *cache, struct cache_entry *entry)
+{
+	if (cache_unlink(cache, entry))
+		cache_link(cache, entry);
+}
+
+/* Adds the new entry in place of the one for the same path, if any */
+static
+void cache_insert(struct cache *cache, struct cache_entry *entry)
+{
+	struct cache_entry *old, *evicted = NULL, **p;
+
+	pthread_mutex_lock(&cache->lock);
+
+	old = cache_find(cache, entry->path);
+	if (old) {
+		cache_unlink(cache, old);
+		old = cache_entry_unref(old);
+	}
+	cache_link(cache, entry);
+
+	if (cache->nentries > cache->max) {
+		/* evict the least recently used one */
+		for (p = &cache->entries; (*p)->next; p = &(*p)->next)
+			;
+		evicted = cache_entry_unref(*p);
+		*p = NULL;
+		cache->nentries--;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	if (old)
+		cache_entry_free(old);
+	if (evicted)
+		cache_entry_free(evicted);
+}
+
+/* Returns the entry with the parsed document for @path, a reference the
+ * caller releases.  *cached is set when it was not parsed by this call.
+ * NULL with errno set when it can not be parsed.  The cache lock is not
+ * held while reading and parsing */
+static
+struct cache_entry *cache_get(struct cache *cache, struct parse_opts *opts,
+			      const char *path, int *cached)
+{
+	struct cache_entry *entry;
+	unsigned long long hash;
+	struct stat st;
+	char *content;
+	int fd, fresh = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	entry = cache_find(cache, path);
+	if (entry) {
+		entry->refs++;
+		fresh = entry->size == st.st_size &&
+			entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+			entry->mtime.tv_nsec == st.st_mtim.tv_nsec;
+		if (fresh) {
+			cache_touch(cache, entry);
+			cache->hits++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+
+	if (fresh)
+		goto hit;
+
+	content = read_content(fd, st.st_size);
+	if (content == NULL) {
+		if (entry)
+			cache_release(cache, entry);
+		close(fd);
+		errno = EIO;
+		return NULL;
+	}
+	hash = content_hash(content, st.st_size);
+
+	/* touched but not changed */
+	if (entry && entry->size == st.st_size && entry->hash == hash) {
+		free(content);
+		pthread_mutex_lock(&cache->lock);
+		entry->mtime = st.st_mtim;
+		cache_touch(cache, entry);
+		cache->hits++;
+		pthread_mutex_unlock(&cache->lock);
+		goto hit;
+	}
+
+	if (entry)
+		cache_release(cache, entry);
+
+	pthread_mutex_lock(&cache->lock);
+	cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	entry = calloc(1, sizeof(*entry));
+	if (entry == NULL)
+		abort();
+	entry->path = strdup(path);
+	if (entry->path == NULL)
+		abort();
+	pthread_rwlock_init(&entry->lock, NULL);
+	/* the one of the cache and the caller's */
+	entry->refs = 2;
+	entry->size = st.st_size;
+	entry->hash = hash;
+	entry->mtime = st.st_mtim;
+	/* the document takes the content over */
+	entry->document = document_parse_content_opts(content, st.st_size,
+						      opts);
+	close(fd);
+
+	if (entry->document == NULL) {
+		cache_entry_free(entry);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	*cached = 0;
+	cache_insert(cache, entry);
+	return entry;
+
+hit:
+	close(fd);
+	*cached = 1;
+	return entry;
+}
+
+/* Builds what @what asks for unless it is already.  The caller holds no
+ * lock of an entry, it would wait for its own readers otherwise */
+static
+void entry_build(struct cache_entry *entry, int what)
+{
+	int built;
+
+	pthread_rwlock_rdlock(&entry->lock);
+	built = entry->built;
+	pthread_rwlock_unlock(&entry->lock);
+
+	if ((built & what) == what)
+		return;
+
+	pthread_rwlock_wrlock(&entry->lock);
+	if (what & (ENTRY_SYMBOLS | ENTRY_INDEX))
+		document_resolve_symbols(entry->document);
+	if ((what & ENTRY_INDEX) && entry->index == NULL)
+		entry->index = posindex_build(entry->document);
+	/* the layout decodes the data out of the statement texts */
+	if (what & ENTRY_TEXT)
+		document_keep_text(entry->document);
+	entry->built |= what;
+	pthread_rwlock_unlock(&entry->lock);
+}
+
+/* Requests, these print the response to the stream of the client */
+
+static
+int request_error(struct client *client, const char *what, const char *arg)
+{
+	fprintf(client->out, "error: %s %s\n", what, arg);
+	return -1;
+}
+
+/* The entry with @what built, released once the request is handled */
+static
+struct cache_entry *request_entry(struct client *client, const char *path,
+				  int what, int *cached)
+{
+	struct cache_entry *entry;
+
+	entry = cache_get(client->cache, &client->opts, path, cached);
+	if (entry == NULL) {
+		fprintf(client->out, "error: %s: %s\n", path,
+			errno == EINVAL ? "failed to parse" : strerror(errno));
+		return NULL;
+	}
+
+	client->entries[client->nentries++] = entry;
+	if (what)
+		entry_build(entry, what);
+	return entry;
+}
+
+/* Read locks the entries of the request once all of these are built, in
+ * the order of their addresses and each one once */
+static
+void request_read(struct client *client)
+{
+	struct cache_entry **entries = client->entries, *entry;
+
+	if (client->nentries == 2 && entries[0] > entries[1]) {
+		entry = entries[0];
+		entries[0] = entries[1];
+		entries[1] = entry;
+	}
+
+	pthread_rwlock_rdlock(&entries[0]->lock);
+	if (client->nentries == 2 && entries[1] != entries[0])
+		pthread_rwlock_rdlock(&entries[1]->lock);
+	client->locked = 1;
+}
+
+static
+void request_done(struct client *client)
+{
+	struct cache_entry **entries = client->entries;
+
+	if (client->locked) {
+		if (client->nentries == 2 && entries[1] != entries[0])
+			pthread_rwlock_unlock(&entries[1]->lock);
+		pthread_rwlock_unlock(&entries[0]->lock);
+		client->locked = 0;
+	}
+
+	while (client->nentries)
+		cache_release(client->cache, entries[--client->nentries]);
+}
+
+static
+int request_parse(struct client *client, char *path)
+{
+	struct cache_entry *entry;
+	int cached;
+
+	entry = request_entry(client, path, 0, &cached);
+	if (entry == NULL)
+		return -1;
+
+	request_read(client);
+	document_print_diagnostics(entry->document, client->out, path);
+	fprintf(client->out, "document: path = %s, statements = %u, "
+		"cached = %d\n", path, entry->document->nstatements, cached);
+
+	return 0;
+}
+
+struct diff_ctx {
+	FILE *out;
+	int changes[SYMBOL_REMOVED + 1];
+};
+
+static
+void diff_symbol_cb(void *arg, const char *name, int status)
+{
+	struct diff_ctx *ctx = arg;
+
+	fprintf(ctx->out, "symbol: name = %s, status = %s\n",
+		name, symbol_status2str(status));
+	ctx->changes[status]++;
+}
+
+static
+int request_diff(struct client *client, char *left_path, char *right_path)
+{
+	struct cache_entry *left, *right;
+	struct diff_ctx ctx = { .out = client->out };
+	int cached;
+
+	left = request_entry(client, left_path, ENTRY_SYMBOLS, &cached);
+	if (left == NULL)
+		return -1;
+	/* the reference keeps the left one should this evict it */
+	right = request_entry(client, right_path, ENTRY_SYMBOLS, &cached);
+	if (right == NULL)
+		return -1;
+
+	request_read(client);
+	document_diff_symbols(left->document, right->document,
+			      diff_symbol_cb, &ctx);
+	fprintf(client->out, "summary: changed = %d, new = %d, removed = %d\n",
+		ctx.changes[SYMBOL_CHANGED], ctx.changes[SYMBOL_NEW],
+		ctx.changes[SYMBOL_REMOVED]);
+
+	return 0;
+}
+
+static
+int request_symbol(struct client *client, char *path, char *name)
+{
+	struct cache_entry *entry;
+	document_t *document;
+	struct symbol *s;
+	int cached;
+
+	entry = request_entry(client, path, ENTRY_SYMBOLS, &cached);
+	if (entry == NULL)
+		return -1;
+
+	request_read(client);
+	document = entry->document;
+	s = document_find_symbol(document, name);
+	if (s == NULL)
+		return request_error(client, "no symbol", name);
+
+	symbol_print(document, client->out, s);
+	return 0;
+}
+
+static
+int request_section(struct client *client, char *path, char *name)
+{
+	struct cache_entry *entry;
+	struct stmt_range *range;
+	section_t *section;
+	statement_t *stmt;
+	unsigned int k;
+	int cached;
+
+	entry = request_entry(client, path, 0, &cached);
+	if (entry == NULL)
+		return -1;
+
+	request_read(client);
+	section = document_find_section(entry->document, name);
+	if (section == NULL)
+		return request_error(client, "no section", name);
+
+	section_print_summary(client->out, section);
+	section_for_each_range(range, section)
+		stmt_range_for_each(stmt, k, range)
+			statement_print(entry->document, client->out, stmt,
+					"");
+	return 0;
+}
+
+static
+int request_position(struct client *client, char *path, char *spec)
+{
+	struct cache_entry *entry;
+	struct position pos;
+	int cached;
+
+	entry = request_entry(client, path, ENTRY_INDEX, &cached);
+	if (entry == NULL)
+		return -1;
+
+	request_read(client);
+	if (posindex_lookup_spec(entry->index, spec, &pos))
+		return request_error(client, "nothing at", spec);
+
+	position_print(entry->index, client->out, &pos);
+	return 0;
+}
+
+static
+int request_layout(struct client *client, char *path)
+{
+	struct cache_entry *entry;
+	struct layout *layout;
+	int cached;
+
+	entry = request_entry(client, path, ENTRY_SYMBOLS | ENTRY_TEXT,
+			      &cached);
+	if (entry == NULL)
+		return -1;
+
+	request_read(client);
+	layout = layout_build(entry->document);
+
+	layout_print(layout, client->out);
+	layout_free(layout);
+	return 0;
+}
+
+static
+int request_stats(struct client *client)
+{
+	struct cache *cache = client->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	fprintf(client->out, "cache: entries = %d, max = %d, hits = %lu, "
+		"misses = %lu\n", cache->nentries, cache->max, cache->hits,
+		cache->misses);
+	pthread_mutex_unlock(&cache->lock);
+
+	if (cache->opts.store) {
+		size_t nbodies, nrefs, bytes;
+
+		body_store_stats(cache->opts.store, &nbodies, &nrefs, &bytes);
+		fprintf(client->out, "bodies: shared = %zu, refs = %zu, "
+			"bytes = %zu\n", nbodies, nrefs, bytes);
+	}
+	return 0;
+}
+
+/* Returns -1 once the response can not be sent */
+static
+int handle_request(struct client *client, char *line)
+{
+	char *argv[4], *saveptr;
+	int argc = 0, rv;
+
+	for (argv[0] = strtok_r(line, " \t\r\n", &saveptr);
+	     argv[argc] && argc < 3;
+	     argv[++argc] = strtok_r(NULL, " \t\r\n", &saveptr))
+		;
+
+	if (argc == 0)
+		return 0;
+
+	if (!strcmp(argv[0], "parse") && argc == 2)
+		rv = request_parse(client, argv[1]);
+	else if (!strcmp(argv[0], "diff") && argc == 3)
+		rv = request_diff(client, argv[1], argv[2]);
+	else if (!strcmp(argv[0], "symbol") && argc == 3)
+		rv = request_symbol(client, argv[1], argv[2]);
+	else if (!strcmp(argv[0], "section") && argc == 3)
+		rv = request_section(client, argv[1], argv[2]);
+	else if (!strcmp(argv[0], "position") && argc == 3)
+		rv = request_position(client, argv[1], argv[2]);
+	else if (!strcmp(argv[0], "layout") && argc == 2)
+		rv = request_layout(client, argv[1]);
+	else if (!strcmp(argv[0], "stats") && argc == 1)
+		rv = request_stats(client);
+	else
+		rv = request_error(client, "bad request", argv[0]);
+
+	if (rv == 0)
+		fprintf(client->out, "ok\n");
+
+	request_done(client);
+	return fflush(client->out) ? -1 : 0;
+}
+
+static
+void *serve_client(void *arg)
+{
+	struct client *client = arg;
+	char *line = NULL;
+	size_t n = 0;
+	FILE *in;
+	int fd;
+
+	in = fdopen(client->fd, "r");
+	fd = in ? dup(client->fd) : -1;
+	client->out = fd >= 0 ? fdopen(fd, "w") : NULL;
+	if (client->out == NULL) {
+		if (fd >= 0)
+			close(fd);
+		if (in)
+			fclose(in);
+		else
+			close(client->fd);
+		free(client);
+		return NULL;
+	}
+
+	/* the scanner of the parses of the client */
+	client->opts.ctx = parse_ctx_new();
+
+	while (getline(&line, &n, in) > 0)
+		if (handle_request(client, line))
+			break;
+
+	parse_ctx_free(client->opts.ctx);
+	free(line);
+	fclose(client->out);
+	fclose(in);
+	free(client);
+	return NULL;
+}
+
+static
+void start_client(struct cache *cache, int fd)
+{
+	struct timeval timeout = { .tv_sec = SEND_TIMEOUT_SEC };
+	struct client *client;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	client = calloc(1, sizeof(*client));
+	if (client == NULL)
+		abort();
+	client->cache = cache;
+	client->fd = fd;
+	client->opts = cache->opts;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, serve_client, client)) {
+		perror("pthread_create");
+		close(fd);
+		free(client);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static
+int listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, rv;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	/* a stale socket of a previous run */
+	unlink(path);
+	/* the socket is created 0600 */
+	mask = umask(0177);
+	rv = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (rv < 0 || listen(fd, 64) < 0) {
+		perror(path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int main(int argc, char **argv)
+{
+	struct cache cache;
+	int lfd, fd;
+
+	prog_name = argv[0];
+
+	argv ++;
+	argc --;
+
+	memset(&cache, 0, sizeof(cache));
+	cache.max = CACHE_ENTRIES_DEFAULT;
+	pthread_mutex_init(&cache.lock, NULL);
+
+	while (argc > 0 && !strncmp(argv[0], "--", 2)) {
+		if (!strcmp(argv[0], "--help")) {
+			usage(stdout);
+		} else if (!strcmp(argv[0], "--dedup")) {
+			cache.opts.store = body_store_new();
+		} else if (argc < 2) {
+			usage(stderr);
+		} else if (!strcmp(argv[0], "--cache")) {
+			cache.max = atoi(argv[1]);
+			argv ++;
+			argc --;
+		} else if (!strcmp(argv[0], "--parse-jobs")) {
+			cache.opts.jobs = atoi(argv[1]);
+			argv ++;
+			argc --;
+		} else {
+			usage(stderr);
+		}
+		argv ++;
+		argc --;
+	}
+
+	if (argc != 1 || cache.max < 2)
+		usage(stderr);
+
+	/* diffs only look at tokens, the symbols are built when asked for
+	 * unless sharing the bodies needs them all anyway */
+	cache.opts.drop = DOCUMENT_DROP_CONTENT;
+	cache.opts.lazy_symbols = cache.opts.store == NULL;
+	cache.opts.padded = 1;
+
+	/* a client going away must not take the server with it */
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = listen_unix(argv[0]);
+	if (lfd < 0)
+		return 1;
+
+	for (;;) {
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			break;
+		}
+		start_client(&cache, fd);
+	}
+
+	close(lfd);
+	return 1;
+}
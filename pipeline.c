@@ -0,0 +1,168 @@
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "document.h"
+#include "parse.h"
+#include "y.tab.h"
+
+YY_DECL;
+
+/*
+ * Pipelined parsing.
+ *
+ * The lexer runs on a thread of its own and hands the tokens over to the
+ * parser through a single-producer single-consumer ring.  Each side
+ * publishes its position once per batch rather than for every token, so
+ * the cache lines holding them do not bounce back and forth.  The tokens
+ * are linked into the document on the parser side, as these are consumed.
+ */
+
+/* power of 2 */
+#define PIPE_SIZE	4096
+#define PIPE_BATCH	64
+
+struct lexed {
+	int type;
+	token_t *token;
+};
+
+struct token_pipe {
+	/* published by the lexer, the slots before it are filled */
+	unsigned int tail __attribute__((aligned(64)));
+	/* published by the parser, the slots before it are free again */
+	unsigned int head __attribute__((aligned(64)));
+	/* set by the parser once it is done, the lexer stops then */
+	int stop;
+
+	/* private to the parser: next slot to consume and the tail seen */
+	unsigned int next __attribute__((aligned(64)));
+	unsigned int ready;
+
+	yyscan_t scanner;
+	document_t *document;
+
+	struct lexed ring[PIPE_SIZE];
+};
+
+/* Waits for the parser to free a slot, returns 0 if it is done instead */
+static
+int pipe_wait_room(struct token_pipe *pipe, unsigned int tail,
+		   unsigned int *head)
+{
+	__atomic_store_n(&pipe->tail, tail, __ATOMIC_RELEASE);
+
+	for (;;) {
+		*head = __atomic_load_n(&pipe->head, __ATOMIC_ACQUIRE);
+		if (tail - *head < PIPE_SIZE)
+			return 1;
+		if (__atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE))
+			return 0;
+		sched_yield();
+	}
+}
+
+static
+void *pipe_lexer(void *arg)
+{
+	struct token_pipe *pipe = arg;
+	unsigned int tail = 0, head = 0;
+	struct lexed *l;
+	YYSTYPE lval;
+	int type;
+
+	do {
+		type = yylex_scan(&lval, pipe->scanner, pipe->document);
+
+		if (tail - head == PIPE_SIZE &&
+		    !pipe_wait_room(pipe, tail, &head)) {
+			if (type)
+				token_free(pipe->document, lval.token);
+			break;
+		}
+
+		l = &pipe->ring[tail++ % PIPE_SIZE];
+		l->type = type;
+		l->token = type ? lval.token : NULL;
+
+		/* the end of input goes out at once */
+		if (type == 0 || tail % PIPE_BATCH == 0) {
+			__atomic_store_n(&pipe->tail, tail, __ATOMIC_RELEASE);
+			if (__atomic_load_n(&pipe->stop, __ATOMIC_ACQUIRE))
+				break;
+		}
+	} while (type);
+
+	return NULL;
+}
+
+/* Parser side of yylex(), returns the next token lexed and links it into
+ * the document */
+int token_pipe_next(document_t *document, token_t **token)
+{
+	struct token_pipe *pipe = document->pipe;
+	struct lexed l;
+
+	if (pipe->next == pipe->ready) {
+		__atomic_store_n(&pipe->head, pipe->next, __ATOMIC_RELEASE);
+		while ((pipe->ready = __atomic_load_n(&pipe->tail,
+						      __ATOMIC_ACQUIRE)) ==
+		       pipe->next)
+			sched_yield();
+	}
+
+	/* the slot is the lexer's again once head is past it */
+	l = pipe->ring[pipe->next++ % PIPE_SIZE];
+	if (pipe->next % PIPE_BATCH == 0)
+		__atomic_store_n(&pipe->head, pipe->next, __ATOMIC_RELEASE);
+
+	if (l.type) {
+		list_append(&document->tokens, &l.token->list);
+		link_token(document, l.token);
+		*token = l.token;
+	}
+
+	return l.type;
+}
+
+/* Same as yyparse() with the lexer running on another thread */
+int document_parse_pipelined(document_t *document, yyscan_t scanner)
+{
+	struct token_pipe *pipe;
+	pthread_t lexer;
+	unsigned int tail;
+	struct lexed *l;
+	int rv;
+
+	pipe = calloc(1, sizeof(*pipe));
+	if (pipe == NULL)
+		abort();
+	pipe->scanner = scanner;
+	pipe->document = document;
+
+	document->pipe = pipe;
+	if (pthread_create(&lexer, NULL, pipe_lexer, pipe)) {
+		document->pipe = NULL;
+		free(pipe);
+		return yyparse(scanner, document);
+	}
+
+	rv = yyparse(scanner, document);
+
+	__atomic_store_n(&pipe->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(lexer, NULL);
+	document->pipe = NULL;
+
+	/* tokens lexed past where the parser stopped */
+	tail = __atomic_load_n(&pipe->tail, __ATOMIC_ACQUIRE);
+	for (; pipe->next != tail; pipe->next++) {
+		l = &pipe->ring[pipe->next % PIPE_SIZE];
+		if (l->type)
+			token_free(document, l->token);
+	}
+
+	free(pipe);
+
+	return rv;
+}
@@ -0,0 +1,248 @@
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "posindex.h"
+
+/*
+ * Position index.
+ *
+ * Tokens and statements are laid out in the content order, so sorted arrays
+ * of these answer what is at an offset by a binary search.  Each statement
+ * also knows the symbol and the section it belongs to, the symbols with the
+ * span of the content their statements cover.
+ */
+
+/* Symbols holding the same statement, the directives of a symbol within
+ * the body of another one: the one labelled last before it wins */
+static
+int pos_symbol_prefer(struct symbol *s, struct symbol *old,
+		      statement_t *stmt)
+{
+	statement_t *label = symbol_aux(s, label), *old_label;
+
+	if (old == NULL)
+		return 1;
+	if (label == NULL || label->id > stmt->id)
+		return 0;
+
+	old_label = symbol_aux(old, label);
+	return old_label == NULL || old_label->id > stmt->id ||
+	       old_label->id < label->id;
+}
+
+static
+void posindex_add_symbols(struct posindex *index)
+{
+	document_t *document = index->document;
+	struct pos_symbol *ps;
+	statement_t *stmt;
+	struct symbol *s;
+	unsigned int i;
+	size_t id;
+	int n = 0, k;
+
+	document_for_each_symbol(s, document)
+		n++;
+
+	index->pos_symbols = calloc(n ? n : 1, sizeof(*index->pos_symbols));
+	if (index->pos_symbols == NULL)
+		abort();
+
+	document_for_each_symbol(s, document) {
+		index->pos_symbols[index->nsymbols].symbol = s;
+		symbol_for_each_statement(stmt, i, s) {
+			k = index->symbols[stmt->id];
+			if (pos_symbol_prefer(s, k < 0 ? NULL :
+					      index->pos_symbols[k].symbol,
+					      stmt))
+				index->symbols[stmt->id] = index->nsymbols;
+		}
+		index->nsymbols++;
+	}
+
+	/* the spans of the statements each ends up with */
+	for (id = 0; id < index->nstatements; id++) {
+		k = index->symbols[id];
+		if (k < 0)
+			continue;
+		stmt = index->statements[id];
+		ps = &index->pos_symbols[k];
+		if (ps->end == 0)
+			ps->start = stmt->offset;
+		ps->end = stmt->offset + stmt->length;
+	}
+}
+
+struct posindex *posindex_build(document_t *document)
+{
+	struct posindex *index;
+	struct stmt_range *range;
+	section_t *section;
+	statement_t *stmt;
+	token_t *token;
+	unsigned int k;
+	size_t i;
+
+	index = calloc(1, sizeof(*index));
+	if (index == NULL)
+		abort();
+	index->document = document;
+
+	list_for_each_entry(token, &document->tokens, list)
+		index->ntokens++;
+	index->tokens = malloc(sizeof(*index->tokens) *
+			       (index->ntokens ? index->ntokens : 1));
+	if (index->tokens == NULL)
+		abort();
+	i = 0;
+	list_for_each_entry(token, &document->tokens, list)
+		index->tokens[i++] = token;
+
+	index->nstatements = document->nstatements;
+	i = index->nstatements ? index->nstatements : 1;
+	index->statements = malloc(sizeof(*index->statements) * i);
+	index->symbols = malloc(sizeof(*index->symbols) * i);
+	index->sections = calloc(i, sizeof(*index->sections));
+	if (index->statements == NULL || index->symbols == NULL ||
+	    index->sections == NULL)
+		abort();
+	list_for_each_entry(stmt, &document->statements, list) {
+		index->statements[stmt->id] = stmt;
+		index->symbols[stmt->id] = -1;
+	}
+
+	for (section = document->sections; section; section = section->next)
+		section_for_each_range(range, section)
+			stmt_range_for_each(stmt, k, range)
+				index->sections[stmt->id] = section;
+
+	posindex_add_symbols(index);
+
+	return index;
+}
+
+void posindex_free(struct posindex *index)
+{
+	free(index->pos_symbols);
+	free(index->sections);
+	free(index->symbols);
+	free(index->statements);
+	free(index->tokens);
+	free(index);
+}
+
+/* Index of the last token starting at or before @offset, -1 if none */
+static
+long token_at(struct posindex *index, size_t offset)
+{
+	size_t lo = 0, hi = index->ntokens, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((size_t)index->tokens[mid]->offset <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (long)lo - 1;
+}
+
+static
+long statement_at(struct posindex *index, size_t offset)
+{
+	size_t lo = 0, hi = index->nstatements, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (index->statements[mid]->offset <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (long)lo - 1;
+}
+
+/* Fills @pos in with what is at @offset, returns -1 if nothing is */
+int posindex_lookup(struct posindex *index, size_t offset,
+		    struct position *pos)
+{
+	token_t *token;
+	statement_t *stmt;
+	long i;
+
+	memset(pos, 0, sizeof(*pos));
+	pos->offset = offset;
+
+	i = token_at(index, offset);
+	if (i >= 0) {
+		token = index->tokens[i];
+		if (offset < (size_t)token->offset + token->length)
+			pos->token = token;
+	}
+
+	i = statement_at(index, offset);
+	if (i >= 0) {
+		stmt = index->statements[i];
+		if (offset < (size_t)stmt->offset + stmt->length) {
+			pos->stmt = stmt;
+			pos->section = index->sections[i];
+			if (index->symbols[i] >= 0)
+				pos->symbol =
+					&index->pos_symbols[index->symbols[i]];
+		}
+	}
+
+	return pos->token || pos->stmt ? 0 : -1;
+}
+
+/* Same at the start of the line @lineno, the first token on it */
+int posindex_lookup_line(struct posindex *index, int lineno,
+			 struct position *pos)
+{
+	long offset;
+
+	offset = document_line_offset(index->document, lineno);
+	if (offset < 0) {
+		memset(pos, 0, sizeof(*pos));
+		return -1;
+	}
+
+	return posindex_lookup(index, offset, pos);
+}
+
+/* @spec is a byte offset or l followed by a line number */
+int posindex_lookup_spec(struct posindex *index, const char *spec,
+			 struct position *pos)
+{
+	char *end;
+	unsigned long n;
+
+	n = strtoul(spec + (*spec == 'l'), &end, 0);
+	if (end == spec + (*spec == 'l') || *end != '\0') {
+		memset(pos, 0, sizeof(*pos));
+		return -1;
+	}
+
+	if (*spec == 'l')
+		return posindex_lookup_line(index, n, pos);
+	return posindex_lookup(index, n, pos);
+}
+
+void position_print(struct posindex *index, FILE *fh, struct position *pos)
+{
+	document_t *document = index->document;
+
+	fprintf(fh, "position: offset = %zu, line = %d\n", pos->offset,
+		document_lineno(document, pos->offset));
+	print_tokens(document, fh, pos->token, 1, "position: token = ");
+	statement_print(document, fh, pos->stmt, "position: statement = ");
+	if (pos->symbol)
+		fprintf(fh, "position: symbol = %s, span = %zu-%zu\n",
+			pos->symbol->symbol->name, pos->symbol->start,
+			pos->symbol->end);
+	if (pos->section)
+		fprintf(fh, "position: section = %s\n", pos->section->name);
+}
@@ -0,0 +1,54 @@
+#ifndef POSINDEX_H_INCLUDED
+#define POSINDEX_H_INCLUDED
+
+#include "document.h"
+
+/* Symbol of a position and the span of the content its statements cover */
+struct pos_symbol {
+	struct symbol *symbol;
+	size_t start, end;
+};
+
+/* Position index: which token, statement, symbol and section are at a byte
+ * offset of the content, built once the document is parsed */
+struct posindex {
+	document_t *document;
+
+	/* tokens in the content order, none once these are dropped */
+	token_t **tokens;
+	size_t ntokens;
+
+	/* statements in the content order, the index is the statement id.
+	 * symbols[i] is the index in pos_symbols of the symbol statement i
+	 * belongs to or -1, sections[i] is its section or NULL */
+	statement_t **statements;
+	int *symbols;
+	section_t **sections;
+	size_t nstatements;
+
+	struct pos_symbol *pos_symbols;
+	int nsymbols;
+};
+
+/* What is at an offset, NULL for the parts it is not in */
+struct position {
+	size_t offset;
+	token_t *token;
+	statement_t *stmt;
+	struct pos_symbol *symbol;
+	section_t *section;
+};
+
+struct posindex *posindex_build(document_t *document);
+void posindex_free(struct posindex *index);
+
+int posindex_lookup(struct posindex *index, size_t offset,
+		    struct position *pos);
+int posindex_lookup_line(struct posindex *index, int lineno,
+			 struct position *pos);
+int posindex_lookup_spec(struct posindex *index, const char *spec,
+			 struct position *pos);
+
+void position_print(struct posindex *index, FILE *fh, struct position *pos);
+
+#endif /* POSINDEX_H_INCLUDED */
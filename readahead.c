@@ -0,0 +1,259 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "document.h"
+
+/*
+ * Reading files ahead of parsing them.
+ *
+ * Batches know all the files they are going to parse.  A pool of reader
+ * threads keeps up to a window of the files following the last one asked
+ * for read into memory, so the reads wait on the disk while the parser
+ * works on the files already there.
+ */
+
+/* readers, each has one of the files of the window in flight */
+#define RA_READERS_MAX	8
+
+enum {
+	RA_PENDING,
+	RA_READY,
+	RA_FAILED,
+	RA_TAKEN,
+};
+
+struct ra_file {
+	char *content;
+	size_t size;
+	int state;
+};
+
+struct readahead {
+	char **paths;
+	struct ra_file *files;
+	size_t n;
+
+	pthread_mutex_t lock;
+	/* readers wait for the window to move, the parsers for the files */
+	pthread_cond_t more, ready;
+	/* next file to read and one past the last one asked for */
+	size_t next, wanted;
+	size_t window;
+	int stop;
+
+	pthread_t *threads;
+	int nthreads;
+};
+
+/* Reads the whole file followed by DOCUMENT_PADDING zero bytes */
+static
+char *ra_read(const char *path, size_t *psize)
+{
+	struct stat st;
+	size_t size, alloc;
+	char *content;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		alloc = st.st_size;
+	else
+		alloc = 65536;
+	content = malloc(alloc + DOCUMENT_PADDING);
+	if (content == NULL)
+		abort();
+
+	for (size = 0;; size += n) {
+		if (size == alloc) {
+			/* grown since or not a regular file */
+			alloc = alloc ? alloc * 2 : 65536;
+			content = realloc(content, alloc + DOCUMENT_PADDING);
+			if (content == NULL)
+				abort();
+		}
+		n = read(fd, content + size, alloc - size);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		else if (n <= 0)
+			break;
+	}
+	close(fd);
+
+	if (n < 0) {
+		free(content);
+		return NULL;
+	}
+
+	memset(content + size, 0, DOCUMENT_PADDING);
+	*psize = size;
+	return content;
+}
+
+static
+void *ra_reader(void *arg)
+{
+	struct readahead *ra = arg;
+	struct ra_file *file;
+	char *content;
+	size_t i, size = 0;
+
+	pthread_mutex_lock(&ra->lock);
+	for (;;) {
+		while (!ra->stop && (ra->next == ra->n ||
+				     ra->next >= ra->wanted + ra->window))
+			pthread_cond_wait(&ra->more, &ra->lock);
+		if (ra->stop)
+			break;
+
+		i = ra->next++;
+		pthread_mutex_unlock(&ra->lock);
+
+		content = ra_read(ra->paths[i], &size);
+
+		pthread_mutex_lock(&ra->lock);
+		file = &ra->files[i];
+		file->content = content;
+		file->size = size;
+		file->state = content ? RA_READY : RA_FAILED;
+		pthread_cond_broadcast(&ra->ready);
+	}
+	pthread_mutex_unlock(&ra->lock);
+
+	return NULL;
+}
+
+/* Up to @window files past the last one asked for are read ahead, with no
+ * window the files are read when asked for */
+struct readahead *readahead_new(char **paths, size_t n, int window)
+{
+	struct readahead *ra;
+	int i, threads;
+
+	ra = calloc(1, sizeof(*ra));
+	if (ra == NULL)
+		abort();
+
+	ra->paths = paths;
+	ra->n = n;
+	ra->files = calloc(n ? n : 1, sizeof(*ra->files));
+	if (window < 0)
+		window = 0;
+	threads = window < RA_READERS_MAX ? window : RA_READERS_MAX;
+	ra->threads = malloc(sizeof(*ra->threads) * (threads ? threads : 1));
+	if (ra->files == NULL || ra->threads == NULL)
+		abort();
+	ra->window = window;
+
+	pthread_mutex_init(&ra->lock, NULL);
+	pthread_cond_init(&ra->more, NULL);
+	pthread_cond_init(&ra->ready, NULL);
+
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&ra->threads[i], NULL, ra_reader, ra))
+			break;
+	ra->nthreads = i;
+
+	return ra;
+}
+
+/* Takes the content of the @i-th file over, reading it here if there are no
+ * readers */
+static
+char *readahead_take(struct readahead *ra, size_t i, size_t *psize)
+{
+	struct ra_file *file = &ra->files[i];
+	char *content = NULL;
+
+	if (ra->nthreads == 0)
+		return ra_read(ra->paths[i], psize);
+
+	pthread_mutex_lock(&ra->lock);
+	if (i + 1 > ra->wanted) {
+		ra->wanted = i + 1;
+		pthread_cond_broadcast(&ra->more);
+	}
+	while (file->state == RA_PENDING)
+		pthread_cond_wait(&ra->ready, &ra->lock);
+	if (file->state == RA_READY) {
+		content = file->content;
+		*psize = file->size;
+	}
+	file->state = RA_TAKEN;
+	pthread_mutex_unlock(&ra->lock);
+
+	return content;
+}
+
+/* Same as document_parse_path_opts() on the @i-th path, each is parsed
+ * once */
+document_t *readahead_parse(struct readahead *ra, size_t i,
+			    const struct parse_opts *opts)
+{
+	struct parse_opts padded_opts = { 0 };
+	document_t *document;
+	char *content;
+	size_t size;
+	FILE *fh;
+
+	content = readahead_take(ra, i, &size);
+	if (content == NULL)
+		return NULL;
+
+	if (opts)
+		padded_opts = *opts;
+	if (padded_opts.name == NULL)
+		padded_opts.name = ra->paths[i];
+
+	if (zinput_format(content, size) != ZINPUT_NONE) {
+		fh = fmemopen(content, size, "r");
+		if (fh == NULL) {
+			free(content);
+			return NULL;
+		}
+		document = document_parse_FILE_opts(fh, &padded_opts);
+		fclose(fh);
+		free(content);
+		return document;
+	}
+
+	padded_opts.padded = 1;
+
+	return document_parse_content_opts(content, size, &padded_opts);
+}
+
+void readahead_free(struct readahead *ra)
+{
+	size_t i;
+	int t;
+
+	pthread_mutex_lock(&ra->lock);
+	ra->stop = 1;
+	pthread_cond_broadcast(&ra->more);
+	pthread_mutex_unlock(&ra->lock);
+
+	for (t = 0; t < ra->nthreads; t++)
+		pthread_join(ra->threads[t], NULL);
+
+	/* files read but never asked for */
+	for (i = 0; i < ra->n; i++)
+		if (ra->files[i].state == RA_READY)
+			free(ra->files[i].content);
+
+	pthread_cond_destroy(&ra->ready);
+	pthread_cond_destroy(&ra->more);
+	pthread_mutex_destroy(&ra->lock);
+	free(ra->threads);
+	free(ra->files);
+	free(ra);
+}
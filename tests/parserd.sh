@@ -0,0 +1,69 @@
+#!/bin/sh
+# vim: set expandtab softtabstop=2 tabstop=2 shiftwidth=2 :
+#
+# Talks to parserd over its socket: the socket is private to the user and a
+# client left idle does not keep the others from being served.
+
+set -e
+
+SCRIPT_PATH=$(dirname $0)
+O=${O:-$SCRIPT_PATH/..}
+
+if test -z "$PARSERD_PATH"; then
+  PARSERD_PATH=$O/parserd
+fi
+
+tmpdir=$(mktemp -d)
+sock=$tmpdir/sock
+pid=
+
+cleanup() {
+  if test -n "$pid"; then
+    kill $pid 2>/dev/null || :
+  fi
+  rm -rf $tmpdir
+}
+trap cleanup EXIT
+
+$PARSERD_PATH $sock &
+pid=$!
+
+for i in $(seq 50); do
+  test -S $sock && break
+  sleep 0.1
+done
+
+mode=$(stat -c %a $sock)
+if test "$mode" != 600; then
+  echo "parserd: socket mode $mode"
+  exit 1
+fi
+
+# the first client connects and says nothing while the second one asks
+python3 - $sock $SCRIPT_PATH/parser/xref.s.in > $tmpdir/out <<'EOF'
+import socket, sys
+
+def connect():
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.settimeout(10)
+    s.connect(sys.argv[1])
+    return s
+
+idle = connect()
+busy = connect()
+busy.sendall(("parse %s\nstats\n" % sys.argv[2]).encode())
+
+out = b""
+while out.count(b"ok\n") < 2:
+    data = busy.recv(4096)
+    if not data:
+        break
+    out += data
+sys.stdout.write(out.decode())
+EOF
+
+grep -q "^document: .*cached = 0$" $tmpdir/out
+grep -q "^cache: entries = 1, max = 64, hits = 0, misses = 1$" $tmpdir/out
+test "$(tail -n 1 $tmpdir/out)" = ok
+
+echo "parserd test OK"
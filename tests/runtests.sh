@@ -13,10 +13,32 @@ if test -z "$GENSRC_PATH"; then
   GENSRC_PATH=$O/gensrc
 fi
 
+# exit status expected from the parser, from $tstname.status or 0
+run_parser() {
+  local status=0
+
+  ${PARSER_PATH} "$@" > $tstname.out || status=$?
+  test $status -eq $expected_status
+}
+
 run_test_parser() {
   local tstname="$1"
+  local args=
+  local expected_status=0
+
+  if test -f $tstname.args; then
+    args=$(cat $tstname.args)
+  fi
+  if test -f $tstname.status; then
+    expected_status=$(cat $tstname.status)
+  fi
+
+  run_parser $args $tstname.in
+
+  diff -u $tstname.out $tstname.expected
 
-  ${PARSER_PATH} $tstname.in > $tstname.out
+  # chunk-parallel parsing must produce the very same output
+  run_parser --jobs 4 --chunk-size 1 $args $tstname.in
 
   diff -u $tstname.out $tstname.expected
 }
@@ -0,0 +1,315 @@
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "xref.h"
+#include "y.tab.h"
+
+struct ids {
+	int *ids;
+	int n, alloc;
+};
+
+static inline
+void ids_add(struct ids *ids, int id)
+{
+	if (ids->n == ids->alloc) {
+		ids->alloc = ids->alloc ? ids->alloc * 2 : 64;
+		ids->ids = realloc(ids->ids, sizeof(*ids->ids) * ids->alloc);
+		if (ids->ids == NULL)
+			abort();
+	}
+	ids->ids[ids->n++] = id;
+}
+
+static
+int id_cmp(const void *a, const void *b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static inline
+int is_ident_start(char c)
+{
+	return isalpha((unsigned char)c) || c == '_' || c == '.';
+}
+
+static inline
+int is_ident(char c)
+{
+	return isalnum((unsigned char)c) || c == '_' || c == '.';
+}
+
+int xref_find(struct xref *xref, const char *name, size_t length)
+{
+	int lo = 0, hi = xref->nsymbols - 1, mid, rv;
+	const char *s;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		s = xref->symbols[mid]->name;
+
+		rv = strncmp(s, name, length);
+		if (rv == 0 && s[length] != '\0')
+			rv = 1;
+
+		if (rv < 0)
+			lo = mid + 1;
+		else if (rv > 0)
+			hi = mid - 1;
+		else
+			return mid;
+	}
+
+	return -1;
+}
+
+/* Look up identifiers in the operand text, skipping registers (%rax),
+ * relocation specifiers (@PLT) and numbers */
+static
+void xref_scan_text(struct xref *xref, const char *text, int skip_first,
+		    struct ids *ids)
+{
+	const char *p = text, *start;
+	int id;
+
+	if (*p == '"')
+		return;
+
+	while (*p) {
+		if (!is_ident(*p)) {
+			p++;
+			continue;
+		}
+
+		start = p;
+		while (is_ident(*p))
+			p++;
+
+		if (!is_ident_start(*start))
+			continue;
+		if (start > text && (start[-1] == '%' || start[-1] == '@'))
+			continue;
+		if (skip_first) {
+			skip_first = 0;
+			continue;
+		}
+
+		id = xref_find(xref, start, p - start);
+		if (id >= 0)
+			ids_add(ids, id);
+	}
+}
+
+static
+void xref_scan_statement(struct xref *xref, statement_t *stmt,
+			 struct ids *ids)
+{
+	token_t *first = statement_first_token(stmt), *token;
+
+	statement_for_each_token(token, stmt) {
+		switch (token->type) {
+		case TOKEN:
+			/* the first one is the instruction mnemonic */
+			xref_scan_text(xref, token->txt, token == first, ids);
+			break;
+		case DIRECTIVE_DATA_DEF:
+			/* skip the directive itself */
+			xref_scan_text(xref, token->txt, 1, ids);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Sorts and drops duplicates and self references */
+static
+int ids_uniq(int *ids, int n, int self)
+{
+	int i, j = 0;
+
+	if (n == 0)
+		return 0;
+	qsort(ids, n, sizeof(*ids), id_cmp);
+
+	for (i = 0; i < n; i++) {
+		if (ids[i] == self || (j && ids[j - 1] == ids[i]))
+			continue;
+		ids[j++] = ids[i];
+	}
+
+	return j;
+}
+
+struct xref *xref_build(document_t *document)
+{
+	struct xref *xref;
+	struct symbol *s;
+	struct ids callees = { NULL, 0, 0 };
+	statement_t *stmt;
+	unsigned int k;
+	int i, j, n, start;
+
+	xref = malloc(sizeof(*xref));
+	if (xref == NULL)
+		abort();
+
+	xref->nsymbols = 0;
+	document_for_each_symbol_sorted(s, document)
+		xref->nsymbols++;
+
+	xref->symbols = malloc(sizeof(*xref->symbols) * (xref->nsymbols + 1));
+	xref->callees_offsets = malloc(sizeof(int) * (xref->nsymbols + 1));
+	xref->callers_offsets = calloc(xref->nsymbols + 1, sizeof(int));
+	if (xref->symbols == NULL || xref->callees_offsets == NULL ||
+	    xref->callers_offsets == NULL)
+		abort();
+
+	/* sorted by name for xref_find() */
+	i = 0;
+	document_for_each_symbol_sorted(s, document)
+		xref->symbols[i++] = s;
+
+	/* callees, grouped by the referring symbol */
+	for (i = 0; i < xref->nsymbols; i++) {
+		start = callees.n;
+		xref->callees_offsets[i] = start;
+
+		symbol_for_each_statement(stmt, k, xref->symbols[i])
+			xref_scan_statement(xref, stmt, &callees);
+
+		n = ids_uniq(callees.ids + start, callees.n - start, i);
+		callees.n = start + n;
+	}
+	xref->callees_offsets[i] = callees.n;
+	xref->callees = callees.ids;
+
+	/* callers, transposed with a counting sort so they come out sorted */
+	for (i = 0; i < callees.n; i++)
+		xref->callers_offsets[callees.ids[i] + 1]++;
+	for (i = 0; i < xref->nsymbols; i++)
+		xref->callers_offsets[i + 1] += xref->callers_offsets[i];
+
+	xref->callers = malloc(sizeof(int) * (callees.n + 1));
+	if (xref->callers == NULL)
+		abort();
+
+	for (i = 0; i < xref->nsymbols; i++) {
+		for (j = xref->callees_offsets[i];
+		     j < xref->callees_offsets[i + 1]; j++) {
+			n = xref->callees[j];
+			xref->callers[xref->callers_offsets[n]++] = i;
+		}
+	}
+	/* the fill above moved each offset to the start of the next symbol */
+	for (i = xref->nsymbols; i > 0; i--)
+		xref->callers_offsets[i] = xref->callers_offsets[i - 1];
+	xref->callers_offsets[0] = 0;
+
+	return xref;
+}
+
+void xref_free(struct xref *xref)
+{
+	free(xref->symbols);
+	free(xref->callees_offsets);
+	free(xref->callees);
+	free(xref->callers_offsets);
+	free(xref->callers);
+	free(xref);
+}
+
+/* Collects the symbols reachable from the @roots, roots included, in the
+ * breadth-first order.  Returns the number of ids stored to *@pids. */
+int xref_closure(struct xref *xref, const int *roots, int nroots,
+		 int direction, int **pids)
+{
+	const int *edges;
+	char *visited;
+	int *queue, head, tail = 0, i, n;
+
+	visited = calloc(xref->nsymbols, 1);
+	queue = malloc(sizeof(*queue) * (xref->nsymbols + 1));
+	if (visited == NULL || queue == NULL)
+		abort();
+
+	for (i = 0; i < nroots; i++) {
+		if (roots[i] < 0 || visited[roots[i]])
+			continue;
+		visited[roots[i]] = 1;
+		queue[tail++] = roots[i];
+	}
+
+	for (head = 0; head < tail; head++) {
+		if (direction == XREF_CALLERS)
+			edges = xref_callers(xref, queue[head], &n);
+		else
+			edges = xref_callees(xref, queue[head], &n);
+
+		for (i = 0; i < n; i++) {
+			if (visited[edges[i]])
+				continue;
+			visited[edges[i]] = 1;
+			queue[tail++] = edges[i];
+		}
+	}
+
+	free(visited);
+	*pids = queue;
+	return tail;
+}
+
+static
+void xref_print_ids(const char *what, const int *ids, int n,
+		    struct xref *xref)
+{
+	int i;
+
+	printf(", %s =", what);
+	for (i = 0; i < n; i++)
+		printf(" %s", xref->symbols[ids[i]]->name);
+}
+
+/* Prints what @name reaches and what reaches it, in the breadth-first
+ * order.  Returns -1 if there is no such symbol */
+int xref_print_closure(struct xref *xref, const char *name)
+{
+	int id, n, *ids;
+
+	id = xref_find(xref, name, strlen(name));
+	if (id < 0)
+		return -1;
+
+	printf("xref: closure = %s", name);
+	n = xref_closure(xref, &id, 1, XREF_CALLEES, &ids);
+	xref_print_ids("callees", ids, n, xref);
+	free(ids);
+	n = xref_closure(xref, &id, 1, XREF_CALLERS, &ids);
+	xref_print_ids("callers", ids, n, xref);
+	free(ids);
+	printf("\n");
+
+	return 0;
+}
+
+void xref_print(struct xref *xref)
+{
+	const int *callees, *callers;
+	int i, ncallees, ncallers;
+
+	for (i = 0; i < xref->nsymbols; i++) {
+		callees = xref_callees(xref, i, &ncallees);
+		callers = xref_callers(xref, i, &ncallers);
+		if (!ncallees && !ncallers)
+			continue;
+
+		printf("xref: name = %s", xref->symbols[i]->name);
+		if (ncallees)
+			xref_print_ids("callees", callees, ncallees, xref);
+		if (ncallers)
+			xref_print_ids("callers", callers, ncallers, xref);
+		printf("\n");
+	}
+}
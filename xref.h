@@ -0,0 +1,47 @@
+#ifndef XREF_H_INCLUDED
+#define XREF_H_INCLUDED
+
+#include "document.h"
+
+/* Symbol reference graph: which symbols are referred to by the operands of
+ * the statements of each symbol (call foo, movq bar(%rip), .quad .LC10) */
+struct xref {
+	/* symbols sorted by name, the index is the symbol id */
+	struct symbol **symbols;
+	int nsymbols;
+
+	/* adjacency arrays: edges of the symbol with id i are
+	 * edges[offsets[i]] .. edges[offsets[i + 1] - 1] */
+	int *callees_offsets, *callees;
+	int *callers_offsets, *callers;
+};
+
+#define XREF_CALLEES	0
+#define XREF_CALLERS	1
+
+struct xref *xref_build(document_t *document);
+void xref_free(struct xref *xref);
+
+int xref_find(struct xref *xref, const char *name, size_t length);
+
+static inline
+const int *xref_callees(struct xref *xref, int id, int *n)
+{
+	*n = xref->callees_offsets[id + 1] - xref->callees_offsets[id];
+	return xref->callees + xref->callees_offsets[id];
+}
+
+static inline
+const int *xref_callers(struct xref *xref, int id, int *n)
+{
+	*n = xref->callers_offsets[id + 1] - xref->callers_offsets[id];
+	return xref->callers + xref->callers_offsets[id];
+}
+
+int xref_closure(struct xref *xref, const int *roots, int nroots,
+		 int direction, int **pids);
+
+void xref_print(struct xref *xref);
+int xref_print_closure(struct xref *xref, const char *name);
+
+#endif /* XREF_H_INCLUDED */
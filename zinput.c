@@ -0,0 +1,496 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/* before the compression headers, these bring stddef.h's offsetof in */
+#include "document.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Compressed input.
+ *
+ * gzip and zstd inputs are recognized by their magic.  When the size of the
+ * decompressed content is known up front, a helper thread decompresses it
+ * chunk by chunk into the final buffer while the scanner reads what is
+ * there so far through YY_INPUT, see zinput_read().  Otherwise, or when the
+ * size turns out wrong, the content is decompressed first and then parsed
+ * the usual way.
+ */
+
+#define ZINPUT_CHUNK	(64 << 10)
+/* deflate does not compress better than that */
+#define ZINPUT_GZIP_RATIO	1032
+
+struct zinput {
+	int format;
+	FILE *fh;
+
+	/* decoder */
+	unsigned char in[ZINPUT_CHUNK];
+	int ended;
+#ifdef HAVE_ZLIB
+	z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream *zds;
+	ZSTD_inBuffer zin;
+#endif
+
+	/* the content, one byte more than the size expected so that a wrong
+	 * guess shows */
+	char *content;
+	size_t alloc;
+
+	/* published by the helper thread under the lock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t avail;
+	int done, error, overflow, stop;
+	pthread_t thread;
+
+	/* consumed by the scanner */
+	size_t pos;
+};
+
+static const struct {
+	const char *name;
+	unsigned char magic[4];
+	size_t length;
+	int supported;
+} zinput_formats[] = {
+	[ZINPUT_GZIP] = { "gzip", { 0x1f, 0x8b }, 2,
+#ifdef HAVE_ZLIB
+			  1
+#endif
+	},
+	[ZINPUT_ZSTD] = { "zstd", { 0x28, 0xb5, 0x2f, 0xfd }, 4,
+#ifdef HAVE_ZSTD
+			  1
+#endif
+	},
+};
+
+/* Format of the content starting with the @n bytes at @magic */
+int zinput_format(const void *magic, size_t n)
+{
+	int i;
+
+	for (i = ZINPUT_GZIP; i <= ZINPUT_ZSTD; i++)
+		if (n >= zinput_formats[i].length &&
+		    !memcmp(magic, zinput_formats[i].magic,
+			    zinput_formats[i].length))
+			return i;
+
+	return ZINPUT_NONE;
+}
+
+/* Looks at the first bytes, the file is rewound */
+int zinput_detect(FILE *fh)
+{
+	unsigned char magic[4];
+	size_t n;
+
+	n = fread(magic, 1, sizeof(magic), fh);
+	rewind(fh);
+
+	return zinput_format(magic, n);
+}
+
+/* Size of the decompressed content if the headers tell, 0 otherwise */
+static
+size_t zinput_size_hint(struct zinput *z)
+{
+	unsigned char buf[18];
+	size_t size = 0;
+	long end;
+
+	switch (z->format) {
+	case ZINPUT_GZIP:
+		/* ISIZE of the last member, modulo 2^32.  That of a truncated
+		 * file is whatever bytes it ends with */
+		if (fseek(z->fh, -4, SEEK_END) == 0 &&
+		    fread(buf, 1, 4, z->fh) == 4)
+			size = buf[0] | buf[1] << 8 | buf[2] << 16 |
+			       (size_t)buf[3] << 24;
+		end = ftell(z->fh);
+		if (end < 0 || size / ZINPUT_GZIP_RATIO > (size_t)end)
+			size = 0;
+		break;
+#ifdef HAVE_ZSTD
+	case ZINPUT_ZSTD: {
+		unsigned long long frame;
+		size_t n;
+
+		n = fread(buf, 1, sizeof(buf), z->fh);
+		frame = ZSTD_getFrameContentSize(buf, n);
+		if (frame != ZSTD_CONTENTSIZE_UNKNOWN &&
+		    frame != ZSTD_CONTENTSIZE_ERROR)
+			size = frame;
+		break;
+	}
+#endif
+	}
+
+	rewind(z->fh);
+	return size;
+}
+
+static
+int zinput_open(struct zinput *z)
+{
+	switch (z->format) {
+#ifdef HAVE_ZLIB
+	case ZINPUT_GZIP:
+		memset(&z->zs, 0, sizeof(z->zs));
+		return inflateInit2(&z->zs, 16 + MAX_WBITS) == Z_OK ? 0 : -1;
+#endif
+#ifdef HAVE_ZSTD
+	case ZINPUT_ZSTD:
+		z->zds = ZSTD_createDStream();
+		if (z->zds == NULL)
+			return -1;
+		z->zin.src = z->in;
+		z->zin.size = z->zin.pos = 0;
+		return ZSTD_isError(ZSTD_initDStream(z->zds)) ? -1 : 0;
+#endif
+	}
+
+	return -1;
+}
+
+static
+void zinput_close(struct zinput *z)
+{
+	switch (z->format) {
+#ifdef HAVE_ZLIB
+	case ZINPUT_GZIP:
+		inflateEnd(&z->zs);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case ZINPUT_ZSTD:
+		ZSTD_freeDStream(z->zds);
+		z->zds = NULL;
+		break;
+#endif
+	}
+}
+
+#ifdef HAVE_ZLIB
+/* Concatenated members are decompressed one after another */
+static
+ssize_t zinput_inflate_gzip(struct zinput *z, char *out, size_t len)
+{
+	z_stream *zs = &z->zs;
+	int rv;
+
+	zs->next_out = (Bytef *)out;
+	zs->avail_out = len;
+
+	while (zs->avail_out) {
+		if (zs->avail_in == 0) {
+			zs->next_in = z->in;
+			zs->avail_in = fread(z->in, 1, sizeof(z->in), z->fh);
+			if (zs->avail_in == 0) {
+				/* truncated */
+				if (ferror(z->fh) || !z->ended)
+					return -1;
+				break;
+			}
+		}
+
+		if (z->ended) {
+			inflateReset(zs);
+			z->ended = 0;
+		}
+
+		rv = inflate(zs, Z_NO_FLUSH);
+		if (rv == Z_STREAM_END)
+			z->ended = 1;
+		else if (rv != Z_OK)
+			return -1;
+	}
+
+	return len - zs->avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static
+ssize_t zinput_inflate_zstd(struct zinput *z, char *out, size_t len)
+{
+	ZSTD_outBuffer zout = { out, len, 0 };
+	size_t rv;
+
+	while (zout.pos < zout.size) {
+		if (z->zin.pos == z->zin.size) {
+			z->zin.pos = 0;
+			z->zin.size = fread(z->in, 1, sizeof(z->in), z->fh);
+			if (z->zin.size == 0) {
+				if (ferror(z->fh) || !z->ended)
+					return -1;
+				break;
+			}
+		}
+
+		rv = ZSTD_decompressStream(z->zds, &zout, &z->zin);
+		if (ZSTD_isError(rv))
+			return -1;
+		/* 0 is the end of a frame */
+		z->ended = rv == 0;
+	}
+
+	return zout.pos;
+}
+#endif
+
+/* Decompresses up to @len bytes, returns the number of bytes, 0 at the end
+ * and -1 on errors */
+static
+ssize_t zinput_inflate(struct zinput *z, char *out, size_t len)
+{
+	switch (z->format) {
+#ifdef HAVE_ZLIB
+	case ZINPUT_GZIP:
+		return zinput_inflate_gzip(z, out, len);
+#endif
+#ifdef HAVE_ZSTD
+	case ZINPUT_ZSTD:
+		return zinput_inflate_zstd(z, out, len);
+#endif
+	}
+
+	return -1;
+}
+
+static
+void *zinput_thread(void *arg)
+{
+	struct zinput *z = arg;
+	size_t avail = 0, len;
+	ssize_t n;
+	int stop;
+
+	do {
+		len = z->alloc - avail;
+		if (len > ZINPUT_CHUNK)
+			len = ZINPUT_CHUNK;
+		n = len ? zinput_inflate(z, z->content + avail, len) : 0;
+		if (n > 0)
+			avail += n;
+
+		pthread_mutex_lock(&z->lock);
+		if (n < 0)
+			z->error = 1;
+		else if (avail == z->alloc)
+			z->overflow = 1;
+		else if (n == 0)
+			z->done = 1;
+		else
+			z->avail = avail;
+		stop = z->stop || z->error || z->overflow || z->done;
+		pthread_cond_broadcast(&z->cond);
+		pthread_mutex_unlock(&z->lock);
+	} while (!stop);
+
+	return NULL;
+}
+
+/* YY_INPUT of the scanner, waits for the helper thread to get ahead */
+size_t zinput_read(struct zinput *z, char *buf, size_t max)
+{
+	size_t n = 0;
+
+	pthread_mutex_lock(&z->lock);
+	while (z->avail == z->pos && !z->done && !z->error && !z->overflow)
+		pthread_cond_wait(&z->cond, &z->lock);
+	if (!z->error && !z->overflow)
+		n = z->avail - z->pos;
+	pthread_mutex_unlock(&z->lock);
+
+	if (n > max)
+		n = max;
+	memcpy(buf, z->content + z->pos, n);
+	z->pos += n;
+
+	return n;
+}
+
+/* Content already in memory read through zinput_read(), for the scanner
+ * to take the content too large for a flex buffer bit by bit */
+struct zinput *zinput_new_plain(const char *content, size_t size)
+{
+	struct zinput *z;
+
+	z = calloc(1, sizeof(*z));
+	if (z == NULL)
+		abort();
+	z->format = ZINPUT_NONE;
+	z->content = (char *)content;
+	z->avail = size;
+	z->done = 1;
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+
+	return z;
+}
+
+void zinput_free_plain(struct zinput *z)
+{
+	pthread_cond_destroy(&z->cond);
+	pthread_mutex_destroy(&z->lock);
+	free(z);
+}
+
+/* Stops and waits for the helper thread, returns the size of the content
+ * or -1 if it could not be decompressed in full */
+ssize_t zinput_finish(struct zinput *z)
+{
+	pthread_mutex_lock(&z->lock);
+	z->stop = 1;
+	pthread_mutex_unlock(&z->lock);
+
+	pthread_join(z->thread, NULL);
+
+	return z->done ? (ssize_t)z->avail : -1;
+}
+
+/* Decompresses the whole input, leaving the padding after it */
+static
+char *zinput_slurp(struct zinput *z, size_t *psize)
+{
+	size_t size = 0, alloc = ZINPUT_CHUNK;
+	char *content;
+	ssize_t n;
+
+	content = malloc(alloc + DOCUMENT_PADDING);
+	if (content == NULL)
+		abort();
+
+	while ((n = zinput_inflate(z, content + size, alloc - size)) > 0) {
+		size += n;
+		if (size == alloc) {
+			alloc *= 2;
+			content = realloc(content, alloc + DOCUMENT_PADDING);
+			if (content == NULL)
+				abort();
+		}
+	}
+	if (n < 0) {
+		z->error = 1;
+		free(content);
+		return NULL;
+	}
+
+	memset(content + size, 0, DOCUMENT_PADDING);
+	*psize = size;
+	return content;
+}
+
+static
+document_t *zinput_parse_slurped(struct zinput *z,
+				 const struct parse_opts *opts)
+{
+	struct parse_opts padded_opts = { 0 };
+	char *content;
+	size_t size;
+
+	content = zinput_slurp(z, &size);
+	if (content == NULL)
+		return NULL;
+
+	if (opts)
+		padded_opts = *opts;
+	padded_opts.padded = 1;
+
+	return document_parse_content_opts(content, size, &padded_opts);
+}
+
+static
+document_t *zinput_parse_streamed(struct zinput *z, size_t size,
+				  const struct parse_opts *opts)
+{
+	document_t *document;
+
+	z->alloc = size + 1;
+	z->content = malloc(z->alloc);
+	if (z->content == NULL)
+		abort();
+
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->cond, NULL);
+	if (pthread_create(&z->thread, NULL, zinput_thread, z)) {
+		free(z->content);
+		return zinput_parse_slurped(z, opts);
+	}
+
+	/* the document takes the content over, even when failing */
+	document = document_parse_input(z->content, z, opts);
+
+	pthread_cond_destroy(&z->cond);
+	pthread_mutex_destroy(&z->lock);
+
+	if (z->overflow) {
+		/* the size was wrong, start over */
+		zinput_close(z);
+		rewind(z->fh);
+		z->ended = 0;
+		if (zinput_open(z))
+			return NULL;
+		document = zinput_parse_slurped(z, opts);
+	}
+
+	return document;
+}
+
+document_t *document_parse_compressed(FILE *fh, int format,
+				      const struct parse_opts *opts)
+{
+	struct zinput *z;
+	document_t *document;
+	size_t size;
+
+	if (!zinput_formats[format].supported) {
+		fprintf(stderr, "%s: %s input is not supported by this build\n",
+			opts && opts->name ? opts->name : "-",
+			zinput_formats[format].name);
+		return NULL;
+	}
+
+	z = calloc(1, sizeof(*z));
+	if (z == NULL)
+		abort();
+	z->format = format;
+	z->fh = fh;
+
+	size = zinput_size_hint(z);
+	if (zinput_open(z)) {
+		free(z);
+		return NULL;
+	}
+
+	/* chunks are split on the whole content */
+	if (size == 0 || (opts && opts->jobs > 1))
+		document = zinput_parse_slurped(z, opts);
+	else
+		document = zinput_parse_streamed(z, size, opts);
+
+	if (z->error && !(opts && opts->quiet))
+		fprintf(stderr, "%s: %s input is corrupt or truncated\n",
+			opts && opts->name ? opts->name : "-",
+			zinput_formats[format].name);
+
+	zinput_close(z);
+	free(z);
+
+	return document;
+}